@@ -17,6 +17,66 @@
 
 #include "hdcapm.h"
 
+static unsigned int buffer_sg = 1;
+module_param(buffer_sg, int, 0644);
+MODULE_PARM_DESC(buffer_sg, "build buffers from single pages and transfer them scatter-gather (def:1)");
+
+/* Back the buffer with order-0 pages, described by an sg table for the
+ * USB payload transfer and vmap'd so the rest of the driver still sees
+ * a flat ptr. Nothing here needs a high order allocation.
+ * One sg entry per page, never coalesced, so the payload can be split
+ * into URBs on page boundaries (see hdcapm_core_recv_payload).
+ */
+static int hdcapm_buffer_alloc_pages(struct hdcapm_buffer *buf)
+{
+	struct scatterlist *sg;
+	u32 i, j;
+
+	buf->nr_pages = DIV_ROUND_UP(buf->maxsize, PAGE_SIZE);
+	buf->pages = kcalloc(buf->nr_pages, sizeof(struct page *), GFP_KERNEL);
+	if (!buf->pages)
+		return -ENOMEM;
+
+	for (i = 0; i < buf->nr_pages; i++) {
+		buf->pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!buf->pages[i])
+			goto fail;
+	}
+
+	if (sg_alloc_table(&buf->sgt, buf->nr_pages, GFP_KERNEL) < 0)
+		goto fail;
+
+	for_each_sg(buf->sgt.sgl, sg, buf->nr_pages, j)
+		sg_set_page(sg, buf->pages[j], min_t(u32, PAGE_SIZE, buf->maxsize - (j * PAGE_SIZE)), 0);
+
+	buf->ptr = vmap(buf->pages, buf->nr_pages, VM_MAP, PAGE_KERNEL);
+	if (!buf->ptr) {
+		sg_free_table(&buf->sgt);
+		goto fail;
+	}
+
+	return 0; /* Success */
+
+fail:
+	while (i--)
+		__free_page(buf->pages[i]);
+	kfree(buf->pages);
+	buf->pages = NULL;
+	return -ENOMEM;
+}
+
+static void hdcapm_buffer_free_pages(struct hdcapm_buffer *buf)
+{
+	u32 i;
+
+	vunmap(buf->ptr);
+	sg_free_table(&buf->sgt);
+	for (i = 0; i < buf->nr_pages; i++)
+		__free_page(buf->pages[i]);
+	kfree(buf->pages);
+	buf->pages = NULL;
+}
+
 struct hdcapm_buffer *hdcapm_buffer_alloc(struct hdcapm_dev *dev, u32 nr, u32 maxsize)
 {
 	struct hdcapm_buffer *buf;
@@ -28,6 +88,15 @@ struct hdcapm_buffer *hdcapm_buffer_alloc(struct hdcapm_dev *dev, u32 nr, u32 ma
 	buf->nr = nr;
 	buf->dev = dev;
 	buf->maxsize = maxsize;
+
+	if (buffer_sg) {
+		if (hdcapm_buffer_alloc_pages(buf) < 0) {
+			kfree(buf);
+			return NULL;
+		}
+		return buf;
+	}
+
 	buf->ptr = kzalloc(maxsize, GFP_KERNEL);
 	if (!buf->ptr) {
 		kfree(buf);
@@ -39,6 +108,11 @@ struct hdcapm_buffer *hdcapm_buffer_alloc(struct hdcapm_dev *dev, u32 nr, u32 ma
 
 void hdcapm_buffer_free(struct hdcapm_buffer *buf)
 {
+	if (buf->pages) {
+		hdcapm_buffer_free_pages(buf);
+		buf->ptr = NULL;
+	}
+
 	if (buf->ptr) {
 		kfree(buf->ptr);
 		buf->ptr = NULL;
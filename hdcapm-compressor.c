@@ -21,6 +21,49 @@
 
 static int hdcapm_compressor_enable_firmware(struct hdcapm_dev *dev, int val);
 
+static unsigned int signal_poll_interval = 1000;
+module_param(signal_poll_interval, int, 0644);
+MODULE_PARM_DESC(signal_poll_interval, "poll the HDMI receiver every N ms during capture, 0 = never (def:1000)");
+
+static unsigned int warm_restart = 0;
+module_param(warm_restart, int, 0644);
+MODULE_PARM_DESC(warm_restart, "keep the codec firmware resident between captures, reinit only the audio DSP (def:0)");
+
+/* How long a warm started capture has to show audio before we reload. */
+#define WARM_AUDIO_TIMEOUT_MS 2000
+
+static unsigned int boot_delay = 1000;
+module_param(boot_delay, int, 0644);
+MODULE_PARM_DESC(boot_delay, "ms to let the boot microcode settle before the firmware load (def:1000)");
+
+static unsigned int fw_ready_timeout = 100;
+module_param(fw_ready_timeout, int, 0644);
+MODULE_PARM_DESC(fw_ready_timeout, "ms to wait for the uploaded firmware to report ready (def:100)");
+
+static unsigned int calibrate_xfer = 0;
+module_param(calibrate_xfer, int, 0644);
+MODULE_PARM_DESC(calibrate_xfer, "measure bulk transfer sizes at stream start, 1 = first start, 2 = every start (def:0)");
+
+static unsigned int prearm = 0;
+module_param(prearm, int, 0644);
+MODULE_PARM_DESC(prearm, "load and configure the encoder ahead of the first read, 1 = on open, 2 = on signal lock (def:0)");
+
+static unsigned int prearm_timeout = 30000;
+module_param(prearm_timeout, int, 0644);
+MODULE_PARM_DESC(prearm_timeout, "tear a pre-armed encoder down after N ms without a read, 0 = never (def:30000)");
+
+static unsigned int fw_idle_spin_us = 200;
+module_param(fw_idle_spin_us, int, 0644);
+MODULE_PARM_DESC(fw_idle_spin_us, "us to poll the firmware busy flag back to back before sleeping (def:200)");
+
+static unsigned int fw_idle_max_sleep_us = 2000;
+module_param(fw_idle_max_sleep_us, int, 0644);
+MODULE_PARM_DESC(fw_idle_max_sleep_us, "cap on the backoff between firmware busy polls in us (def:2000)");
+
+static unsigned int fw_idle_hrtimer = 0;
+module_param(fw_idle_hrtimer, int, 0644);
+MODULE_PARM_DESC(fw_idle_hrtimer, "sleep between firmware busy polls on an exact hrtimer, no slack (def:0)");
+
 static char *cmd_name(u32 id)
 {
 	switch(id) {
@@ -31,74 +74,184 @@ static char *cmd_name(u32 id)
 	}
 }
 
+/* Latency histogram slot for a command id, see cmd_name(). */
+static int cmd_index(u32 id)
+{
+	switch(id) {
+	case 0x01: return HDCAPM_FW_CMD_START;
+	case 0x02: return HDCAPM_FW_CMD_STOP;
+	case 0x10: return HDCAPM_FW_CMD_CONFIGURE;
+	default:   return HDCAPM_FW_CMD_OTHER;
+	}
+}
+
+static void fw_idle_sleep(u32 us)
+{
+	ktime_t t;
+
+	if (fw_idle_hrtimer) {
+		t = ns_to_ktime((u64)us * NSEC_PER_USEC);
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		schedule_hrtimeout_range(&t, 0, HRTIMER_MODE_REL);
+	} else
+		usleep_range(us, us + us / 2);
+}
+
 /* Wait up to 500ms for the firmware to be ready, or return a timeout.
+ * Most commands retire in well under a millisecond, so poll back to back
+ * for fw_idle_spin_us (each read is a bus round trip anyway), then sleep
+ * from 50us doubling up to fw_idle_max_sleep_us. A plain msleep(10) here
+ * was 10-20ms per command on a HZ=100 kernel.
  * On idle, value 1 is return else < 0 indicates an error.
  */
 static int fw_check_idle(struct hdcapm_dev *dev)
 {
-	unsigned long timeout = jiffies + msecs_to_jiffies(500);
-	int ret = -ETIMEDOUT;
+	ktime_t start = ktime_get();
+	u32 sleep_us = 50;
+	s64 elapsed;
 	u32 val;
 
-	while (!time_after(jiffies, timeout)) {
+	for (;;) {
+		dev->totals.fw_idle_reads++;
+		if (hdcapm_read32(dev, REG_FW_CMD_BUSY, &val) != 0)
+			return -EINVAL; /* Error trying to read register. */
 
-		if (hdcapm_read32(dev, REG_FW_CMD_BUSY, &val) != 0) {
-			ret = -EINVAL; /* Error trying to read register. */
-			break;
-		}
+		if (val == 0)
+			return 1; /* Success - Firmware is idle. */
 
-		if (val == 0) {
-			ret = 1; /* Success - Firmware is idle. */
-			break;
-		}
+		elapsed = ktime_us_delta(ktime_get(), start);
+		if (elapsed > 500 * USEC_PER_MSEC)
+			return -ETIMEDOUT;
+
+		if (elapsed < fw_idle_spin_us)
+			continue;
 
-		msleep(10);
+		dev->totals.fw_idle_sleeps++;
+		fw_idle_sleep(sleep_us);
+		sleep_us = min(sleep_us * 2, max(fw_idle_max_sleep_us, 50U));
 	}
+}
 
-	return ret;
+/* Poll for the uploaded firmware to come up, the QSOS signature at 0x40
+ * and 0xBC804 clear. Returns 1 when ready, 0 on timeout, which the caller
+ * treats the way the fixed sleep this replaced did, it carries on.
+ */
+static int fw_wait_ready(struct hdcapm_dev *dev, u32 timeout_ms)
+{
+	unsigned long timeout = jiffies + msecs_to_jiffies(timeout_ms);
+	u32 sig = 0, val = 0;
+
+	do {
+		if (hdcapm_mem_read32(dev, 0x00000040, &sig) == 0 && sig == 0x534f5351 && /* QSOS */
+			hdcapm_mem_read32(dev, 0x000BC804, &val) == 0 && val == 0)
+			return 1;
+
+		usleep_range(1000, 2000);
+	} while (!time_after(jiffies, timeout));
+
+	dprintk(1, "%s() timeout, sig = 0x%08x 0xbc804 = 0x%08x\n", __func__, sig, val);
+	return 0;
 }
 
-/* Send a command to the firmware.
- *
- * Firmware commands and arguments are passed to this function for
- * transmission to the hardware.
- * An array of u32s, with the first u32 being the command type, followed
- * by N arguments that are written to ARGS[0-n].
+/* Firmware command scripts. Each command is in the layout the firmware
+ * mailbox takes, the command id followed by N arguments for ARGS[0-n].
+ */
+struct fw_script_cmd {
+	const u32 *cmd;
+	u32 entries;
+};
+#define FW_SCRIPT_CMD(arr) { (arr), CMD_ARRAY_SIZE(arr) }
+
+static const char * const fw_script_names[HDCAPM_FW_SCRIPTS] = {
+	[HDCAPM_FW_SCRIPT_START]     = "start",
+	[HDCAPM_FW_SCRIPT_STOP]      = "stop",
+	[HDCAPM_FW_SCRIPT_CONFIGURE] = "configure",
+};
+
+/* Run a script of firmware commands back to back.
+ * Each command goes out as one register batch: the arguments, the busy
+ * flag, the execute register and a read back of the busy flag. Only when
+ * that read shows the firmware still busy do we poll for idle, so a
+ * script of N quick commands costs N batches and a single idle check.
+ * The last command isn't waited on, the next script's first check is.
  * Return 0 on success else < 0.
  */
-static int execute_cmd(struct hdcapm_dev *dev, const u32 *cmdarr, u32 entries)
+static int run_script(struct hdcapm_dev *dev, int id, const struct fw_script_cmd *cmds, u32 count)
 {
-	int ret;
-	int i;
+	struct hdcapm_fw_script_timing *t = &dev->fw_script_last[id];
+	struct hdcapm_batch batch;
+	ktime_t start, cmd_start;
+	u32 busy = 0;
+	u32 us;
+	int ret = 0;
+	u32 i, j;
 
-	/* Check hardware is ready */
 	mutex_lock(&dev->lock);
 
-	if (fw_check_idle(dev)) {
+	memset(t, 0, sizeof(*t));
+	t->name = fw_script_names[id];
+	start = ktime_get();
+	kl_histogram_sample_begin(&dev->totals.fw_script[id]);
 
-		dprintk(1, "FIRMWARE CMD = 0x%08x [%s]\n", *cmdarr, cmd_name(*cmdarr));
+	/* Check hardware is ready */
+	t->idle_polls++;
+	if (fw_check_idle(dev) <= 0) {
+		ret = -EINVAL;
+		goto out;
+	}
 
-		/* Send a new command to the hardware/firmware. */
-		/* Write all args into the FW arg registers */
-		for (i = 1; i < entries; i++) {
-			dprintk(1, "           %2d: 0x%08x\n", i - 1, *(cmdarr + i));
-		}
-		for (i = 1; i < entries; i++) {
-			hdcapm_write32(dev, REG_FW_CMD_ARG(i - 1), *(cmdarr + i));
+	for (i = 0; i < count; i++) {
+		const u32 *cmdarr = cmds[i].cmd;
+
+		cmd_start = ktime_get();
+		dprintk(1, "FIRMWARE CMD = 0x%08x [%s]\n", *cmdarr, cmd_name(*cmdarr));
+		for (j = 1; j < cmds[i].entries; j++)
+			dprintk(1, "           %2d: 0x%08x\n", j - 1, *(cmdarr + j));
+
+		hdcapm_batch_begin(dev, &batch);
+		for (j = 1; j < cmds[i].entries; j++)
+			hdcapm_batch_write32(&batch, REG_FW_CMD_ARG(j - 1), *(cmdarr + j));
+
+		/* Prepare the firmware to execute a command, then trigger it. */
+		hdcapm_batch_write32(&batch, REG_FW_CMD_BUSY, 1);
+		hdcapm_batch_write32(&batch, REG_FW_CMD_EXECUTE, *cmdarr);
+		hdcapm_batch_read32(&batch, REG_FW_CMD_BUSY, &busy);
+
+		ret = hdcapm_batch_commit(&batch);
+		if (ret < 0)
+			goto out;
+
+		if (i + 1 < count && busy) {
+			t->idle_polls++;
+			if (fw_check_idle(dev) <= 0) {
+				ret = -EINVAL;
+				goto out;
+			}
+			busy = 0;
 		}
 
-		/* Prepare the firmware to execute a command. */
-		hdcapm_write32(dev, REG_FW_CMD_BUSY, 1);
+		/* Per command latency, execute to idle, when we saw it retire. */
+		if (!busy) {
+			us = ktime_us_delta(ktime_get(), cmd_start);
+			dev->totals.fw_cmd_lat_us[cmd_index(*cmdarr)][min_t(u32, fls(us), HDCAPM_EP_LAT_BUCKETS - 1)]++;
+		}
 
-		/* Trigger the command execution. */
-		hdcapm_write32(dev, REG_FW_CMD_EXECUTE, *cmdarr);
+		if (i < HDCAPM_FW_SCRIPT_MAX_CMDS) {
+			t->cmd[i] = *cmdarr;
+			t->cmd_us[i] = ktime_us_delta(ktime_get(), cmd_start);
+		}
+		t->count++;
+	}
+	kl_histogram_sample_complete(&dev->totals.fw_script[id]);
 
-		ret = 0; /* Success */
-	} else
-		ret = -EINVAL;
- 
+out:
+	t->total_us = ktime_us_delta(ktime_get(), start);
 	mutex_unlock(&dev->lock);
 
+	if (ret < 0)
+		pr_err(KBUILD_MODNAME ": firmware %s script failed at command %d, ret = %d\n",
+			t->name, t->count, ret);
+
 	return ret;
 }
 
@@ -225,6 +378,35 @@ static const u32 cmd_30[] = {
 	0x00000000, /* Fixed value */
 };
 
+/* Stop and disable encoder. */
+static const struct fw_script_cmd fw_stop_script[] = {
+	FW_SCRIPT_CMD(cmd_02), /* Stop */
+	FW_SCRIPT_CMD(cmd_f3),
+};
+
+/* The part of a start that doesn't depend on the input timings, see prearm. */
+static const struct fw_script_cmd fw_configure_script[] = {
+	/* From LGP device dump line 27788 */
+	FW_SCRIPT_CMD(cmd_f1),
+	FW_SCRIPT_CMD(cmd_f2),
+
+	/* Configure the video / audio compressors. */
+	FW_SCRIPT_CMD(cmd_10_0f),
+	FW_SCRIPT_CMD(cmd_10_10),
+	FW_SCRIPT_CMD(cmd_10_12),
+	FW_SCRIPT_CMD(cmd_10_13),
+	FW_SCRIPT_CMD(cmd_10_16),
+	FW_SCRIPT_CMD(cmd_10_17),
+	FW_SCRIPT_CMD(cmd_10_02),
+};
+
+static int firmware_configure(struct hdcapm_dev *dev)
+{
+	hdcapm_compressor_enable_firmware(dev, 1);
+
+	return run_script(dev, HDCAPM_FW_SCRIPT_CONFIGURE, fw_configure_script, ARRAY_SIZE(fw_configure_script));
+}
+
 static int firmware_transition(struct hdcapm_dev *dev, int run, struct v4l2_dv_timings *timings)
 {
 	struct hdcapm_encoder_parameters *p = &dev->encoder_parameters;
@@ -232,12 +414,20 @@ static int firmware_transition(struct hdcapm_dev *dev, int run, struct v4l2_dv_t
 	/* 29298 in LGPEncoder/complete-trace.tdc */
 	u32 cfg[12];
 
+	/* fw_configure_script first, unless the encoder is pre-armed. */
+	const struct fw_script_cmd start[] = {
+		/* Configure and start encoder. */
+		FW_SCRIPT_CMD(cfg), /* Start */
+		FW_SCRIPT_CMD(cmd_0a),
+	};
+
 	u32 i_width, i_height, i_fps;
 	u32 o_width, o_height, o_fps;
 	u32 min_bitrate_kbps = dev->encoder_parameters.bitrate_bps / 1000;
 	u32 max_bitrate_kbps = dev->encoder_parameters.bitrate_peak_bps / 1000;
 	u32 htotal, vtotal;
 	u32 timing_fpsx100;
+	int ret;
 
 	dprintk(1, "%s(%p, %s)\n", __func__, dev, run == 1 ? "START" : "STOP");
 	if (run) {
@@ -299,58 +489,126 @@ static int firmware_transition(struct hdcapm_dev *dev, int run, struct v4l2_dv_t
 		cfg[10] = 0x21121080;
 		cfg[11] = 0x465001f2;
 
-		hdcapm_compressor_enable_firmware(dev, 1);
+		/* A pre-armed encoder is configured already, it only needs the start. */
+		if (!dev->armed) {
+			ret = firmware_configure(dev);
+			if (ret < 0)
+				return ret;
+		}
+		dev->armed = 0;
+
+		return run_script(dev, HDCAPM_FW_SCRIPT_START, start, ARRAY_SIZE(start));
+	}
 
-		/* From LGP device dump line 27788 */
-		execute_cmd(dev, cmd_f1, CMD_ARRAY_SIZE(cmd_f1));
-		execute_cmd(dev, cmd_f2, CMD_ARRAY_SIZE(cmd_f2));
+	dev->armed = 0;
+	return run_script(dev, HDCAPM_FW_SCRIPT_STOP, fw_stop_script, ARRAY_SIZE(fw_stop_script));
+}
 
-		/* Configure the video / audio compressors. */
-		execute_cmd(dev, cmd_10_0f, CMD_ARRAY_SIZE(cmd_10_0f)); /* */
-		execute_cmd(dev, cmd_10_10, CMD_ARRAY_SIZE(cmd_10_10)); /* */
-		execute_cmd(dev, cmd_10_12, CMD_ARRAY_SIZE(cmd_10_12)); /* */
-		execute_cmd(dev, cmd_10_13, CMD_ARRAY_SIZE(cmd_10_13)); /* */
-		execute_cmd(dev, cmd_10_16, CMD_ARRAY_SIZE(cmd_10_16)); /* */
-		execute_cmd(dev, cmd_10_17, CMD_ARRAY_SIZE(cmd_10_17)); /* */
-		execute_cmd(dev, cmd_10_02, CMD_ARRAY_SIZE(cmd_10_02)); /* */
+/* Does the TS chunk start an audio PES (MPEG audio 0xc0-0xdf or private 0xbd)?
+ * The firmware hands us whole packets, a chunk that isn't aligned is skipped.
+ */
+static int ts_has_audio(const u8 *p, u32 len)
+{
+	u32 i, off;
 
-		/* Configure and start encoder. */
-		execute_cmd(dev, cfg, CMD_ARRAY_SIZE(cfg)); /* Start */
-		execute_cmd(dev, cmd_0a, CMD_ARRAY_SIZE(cmd_0a)); /* */
-#if 0
-		msleep(500);
-
-printk("Stopping(1)\n");
-		/* Stop and disable encoder. */
-		execute_cmd(dev, cmd_02, CMD_ARRAY_SIZE(cmd_02)); /* Stop */
-		execute_cmd(dev, cmd_f3, CMD_ARRAY_SIZE(cmd_f3));
-
-printk("Starting(2)\n");
-		/* Now start it again. */
-		execute_cmd(dev, cmd_f1, CMD_ARRAY_SIZE(cmd_f1));
-		execute_cmd(dev, cmd_f2, CMD_ARRAY_SIZE(cmd_f2));
-		execute_cmd(dev, cfg, CMD_ARRAY_SIZE(cfg)); /* Start */
-		execute_cmd(dev, cmd_0a, CMD_ARRAY_SIZE(cmd_0a)); /* */
-#endif
-	} else {
-		/* Stop and disable encoder. */
-		execute_cmd(dev, cmd_02, CMD_ARRAY_SIZE(cmd_02)); /* Stop */
-		execute_cmd(dev, cmd_f3, CMD_ARRAY_SIZE(cmd_f3));
+	for (i = 0; i + 188 <= len; i += 188) {
+		if (p[i] != 0x47)
+			return 0;
+
+		/* Payload unit start, with a payload. */
+		if (!(p[i + 1] & 0x40) || !(p[i + 3] & 0x10))
+			continue;
+
+		off = 4;
+		if (p[i + 3] & 0x20)
+			off += 1 + p[i + 4];
+		if (off + 4 > 188)
+			continue;
+
+		if (p[i + off] == 0x00 && p[i + off + 1] == 0x00 && p[i + off + 2] == 0x01 &&
+			((p[i + off + 3] & 0xe0) == 0xc0 || p[i + off + 3] == 0xbd))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Validate a TS buffer descriptor (regs 0x6b0-0x6c8) before we act on it. */
+static int tsb_check(const u32 *arr)
+{
+	/* Check this is a TS buffer */
+	if ((arr[0] & 0xff) != 0x40) {
+		/* Unexpected, debug this. Seen in the field, the transfer still works. */
+		printk(KERN_ERR "tsb reply: %08x %08x %08x %08x %08x %08x %08x (No 0x40?)\n",
+			arr[0], arr[1], arr[2], arr[3], arr[4], arr[5], arr[6]);
+	}
+
+	/* Check this other fixed value. */
+	if ((arr[1] & 0xff) != 0x83) {
+		printk(KERN_ERR "tsb reply: %08x %08x %08x %08x %08x %08x %08x (No 0x83?)\n",
+			arr[0], arr[1], arr[2], arr[3], arr[4], arr[5], arr[6]);
+		return -EPROTO;
+	}
 
-		//hdcapm_compressor_enable_firmware(dev, 0);
-		//hdcapm_write32(dev, REG_FW_CMD_BUSY, 0);
+	if (arr[4] * sizeof(u32) > 256000) {
+		printk(KERN_ERR "tsb reply: %08x %08x %08x %08x %08x %08x %08x (Too many dwords?)\n",
+			arr[0], arr[1], arr[2], arr[3], arr[4], arr[5], arr[6]);
+		return -EPROTO;
 	}
 
 	return 0;
 }
 
+/* Acknowledge a TS buffer back to the firmware, it may then reuse it. */
+static int __tsb_ack(struct hdcapm_dev *dev, const u32 *arr)
+{
+	struct hdcapm_batch batch;
+	u32 val;
+
+	if (hdcapm_read32(dev, 0x800, &val) < 0)
+		return -EIO;
+
+	hdcapm_batch_begin(dev, &batch);
+	hdcapm_batch_write32(&batch, 0x800, val);
+
+	hdcapm_batch_write32(&batch, REG_FW_CMD_ARG(0), 0x83);
+	hdcapm_batch_write32(&batch, REG_FW_CMD_ARG(1), arr[4]);
+	hdcapm_batch_write32(&batch, REG_FW_CMD_ARG(2), 0x2aaaaaaa);
+	hdcapm_batch_write32(&batch, REG_FW_CMD_ARG(3), 0);
+	hdcapm_batch_write32(&batch, REG_FW_CMD_ARG(5), 0);
+	hdcapm_batch_write32(&batch, REG_FW_CMD_BUSY, 1);
+	hdcapm_batch_write32(&batch, REG_FW_CMD_EXECUTE, 0x30);
+
+	hdcapm_batch_write32(&batch, 0x6c8, 0);
+	if (hdcapm_batch_commit(&batch) < 0)
+		return -EIO;
+
+	return 0;
+}
+
+static int tsb_ack(struct hdcapm_dev *dev, const u32 *arr)
+{
+	int ret;
+
+	hdcapm_core_usb_lock_class(dev, HDCAPM_SCHED_DATA);
+	ret = __tsb_ack(dev, arr);
+	hdcapm_core_usb_unlock(dev);
+
+	return ret;
+}
+
 /* Perform a status read of the compressor. If TS data is available then
  * query that and push the buffer into a user queue for later processing.
+ * Each phase (status, payload, ack) owns the wire at the highest priority,
+ * firmware commands and I2C queue behind it. The wire is free between the
+ * phases, see __hdcapm_dmaread32().
+ * Returns 0 when a buffer was queued, -EAGAIN when the firmware had nothing
+ * for us, -EIO / -EPROTO on transport or protocol failures that need
+ * hdcapm_compressor_recover(), other errors are handled locally.
  */
 static int usb_read(struct hdcapm_dev *dev)
 {
 	struct hdcapm_buffer *buf;
-	u32 val;
 	u32 arr[7];
 	u8 r[4];
 	int ret, i;
@@ -368,10 +626,12 @@ static int usb_read(struct hdcapm_dev *dev)
 	 */
 
 	kl_histogram_sample_begin(&dev->stats->usb_codec_status);
+	hdcapm_core_usb_lock_class(dev, HDCAPM_SCHED_DATA);
 	ret = hdcapm_read32_array(dev, REG_06B0, ARRAY_SIZE(arr), &arr[0], 1);
+	hdcapm_core_usb_unlock(dev);
 	if (ret < 0) {
 		/* Failure to read from the device. */
-		return -EINVAL;
+		return ret;
 	}
 	kl_histogram_sample_complete(&dev->stats->usb_codec_status);
 
@@ -382,50 +642,40 @@ static int usb_read(struct hdcapm_dev *dev)
 	if (arr[6] == 0) {
 		/* Buffer not yet ready. */
 		dev->stats->codec_ts_not_yet_ready++;
-		return -ETIMEDOUT;
+		return -EAGAIN;
 	}
 
-	/* Check this is a TS buffer */
-	if ((arr[0] & 0xff) != 0x40) {
-		/* Unexpected, debug this. */
-		printk(KERN_ERR "tsb reply: %08x %08x %08x %08x %08x %08x %08x (No 0x40?)\n",
-			arr[0], arr[1], arr[2], arr[3], arr[4], arr[5], arr[6]);
-		//BUG();
-	}
-
-	/* Check this other fixed value. */
-	if ((arr[1] & 0xff) != 0x83) {
-		/* Unexpected, debug this. */
-		printk(KERN_ERR "tsb reply: %08x %08x %08x %08x %08x %08x %08x (No 0x83?)\n",
-			arr[0], arr[1], arr[2], arr[3], arr[4], arr[5], arr[6]);
-		BUG();
-	}
+	ret = tsb_check(arr);
+	if (ret < 0)
+		return ret;
 
 	bytes_to_read = arr[4] * sizeof(u32);
-	if (bytes_to_read > 256000) {
-		/* Unexpected, debug this. */
-		printk(KERN_ERR "tsb reply: %08x %08x %08x %08x %08x %08x %08x (Too many dwords?)\n",
-			arr[0], arr[1], arr[2], arr[3], arr[4], arr[5], arr[6]);
-		BUG();
-	}
 
 	/* We need a buffer to transfer the TS into. */
 	kl_histogram_sample_begin(&dev->stats->usb_buffer_acquire);
 	buf = hdcapm_buffer_next_free(dev);
 	if (!buf)
-		return -EINVAL;
+		return -ENOMEM;
 
 	kl_histogram_sample_complete(&dev->stats->usb_buffer_acquire);
 
+	if (bytes_to_read > buf->maxsize) {
+		/* Legal for the firmware, but we can't hold it. Drop it so the firmware moves on. */
+		printk(KERN_ERR "%s() chunk of %d bytes exceeds buffer_size %d, dropped\n", __func__, bytes_to_read, buf->maxsize);
+		hdcapm_buffer_add_to_free(dev, buf);
+		dev->stats->buffer_overrun++;
+		return tsb_ack(dev, arr) < 0 ? -EIO : -EMSGSIZE;
+	}
+
 	kl_histogram_update(&dev->stats->usb_read_call_interval);
 
 	/* Transfer buffer from the USB device (address arr[2]), length arr[4]). */
 	kl_histogram_sample_begin(&dev->stats->usb_codec_transfer);
-	ret = hdcapm_dmaread32(dev, arr[2], (u32 *)buf->ptr, arr[4]);
+	ret = hdcapm_dmaread32_buffer(dev, arr[2], buf, arr[4]);
 	if (ret < 0) {
 		/* Throw the buffer back in the free list. */
 		hdcapm_buffer_add_to_free(dev, buf);
-		return -EINVAL;
+		return ret;
 	}
 	kl_histogram_sample_complete(&dev->stats->usb_codec_transfer);
 
@@ -446,6 +696,9 @@ static int usb_read(struct hdcapm_dev *dev)
 	}
 #endif
 
+	if (!dev->audio_seen && ts_has_audio(buf->ptr, bytes_to_read))
+		dev->audio_seen = 1;
+
 	dev->stats->codec_bytes_received += bytes_to_read; 
 	dev->stats->codec_buffers_received++;
 
@@ -455,25 +708,13 @@ static int usb_read(struct hdcapm_dev *dev)
 	buf->readpos = 0;
 	hdcapm_buffer_add_to_used(dev, buf);
 	kl_histogram_sample_complete(&dev->stats->usb_buffer_handoff);
+	hdcapm_core_session_mark(dev, HDCAPM_PHASE_FIRST_BUFFER);
 
 	/* Signal to any userland waiters, new buffer available. */
 	wake_up_interruptible(&dev->wait_read);
 
 	/* Acknowledge the buffer back to the firmware. */
-	hdcapm_read32(dev, 0x800, &val);
-	hdcapm_write32(dev, 0x800, val);
-
-	hdcapm_write32(dev, REG_FW_CMD_ARG(0), 0x83);
-	hdcapm_write32(dev, REG_FW_CMD_ARG(1), arr[4]);
-	hdcapm_write32(dev, REG_FW_CMD_ARG(2), 0x2aaaaaaa);
-	hdcapm_write32(dev, REG_FW_CMD_ARG(3), 0);
-	hdcapm_write32(dev, REG_FW_CMD_ARG(5), 0);
-	hdcapm_write32(dev, REG_FW_CMD_BUSY, 1);
-	hdcapm_write32(dev, REG_FW_CMD_EXECUTE, 0x30);
-
-	hdcapm_write32(dev, 0x6c8, 0);
-	
-	return 0;
+	return tsb_ack(dev, arr);
 }
 
 void hdcapm_compressor_init_gpios(struct hdcapm_dev *dev)
@@ -524,38 +765,257 @@ static int hdcapm_compressor_enable_firmware(struct hdcapm_dev *dev, int val)
 	return 0; /* Success */
 }
 
+/* pl330b_lib_reinit, issued as a single pipelined batch.
+ * The second pass during bring-up (trace line 12570) also clears the firmware busy flag.
+ */
+static int pl330b_lib_reinit(struct hdcapm_dev *dev, int clear_busy)
+{
+	struct hdcapm_batch batch;
+
+	hdcapm_batch_begin(dev, &batch);
+
+	if (clear_busy)
+		hdcapm_batch_write32(&batch, REG_FW_CMD_BUSY, 0x00000000);
+
+	hdcapm_batch_write32(&batch, REG_081C, 0x00004000);
+	hdcapm_batch_write32(&batch, REG_0820, 0x00103FFF);
+	hdcapm_batch_write32(&batch, REG_0824, 0x00000000);
+
+	hdcapm_batch_write32(&batch, REG_0828, 0x00104000);
+	hdcapm_batch_write32(&batch, REG_082C, 0x00203FFF);
+	hdcapm_batch_write32(&batch, REG_0830, 0x00100000);
+
+	hdcapm_batch_write32(&batch, REG_0834, 0x00204000);
+	hdcapm_batch_write32(&batch, REG_0838, 0x00303FFF);
+	hdcapm_batch_write32(&batch, REG_083C, 0x00200000);
+
+	hdcapm_batch_write32(&batch, REG_0840, 0x70003124);
+	hdcapm_batch_write32(&batch, REG_0840, 0x90003124);
+
+	return hdcapm_batch_commit(&batch);
+}
+
+/* Upload a firmware image into device memory at addr, in sizing.ep2_chunk_dwords dmawrite chunks.
+ * Each dmawrite finishes before the next command goes out, the way the original protocol ran.
+ */
+static int hdcapm_compressor_upload(struct hdcapm_dev *dev, const char *name, size_t len, u32 addr)
+{
+	struct hdcapm_fw_image *img;
+	ktime_t start;
+	s64 us;
+	int ret;
+
+	img = hdcapm_fw_get(dev, name, len);
+	if (IS_ERR(img) && PTR_ERR(img) == -ENOENT) {
+		if (dev->ops->fw_optional) {
+			pr_info(KBUILD_MODNAME ": no firmware file %s, %s transport continues without it.\n",
+				name, dev->ops->name);
+			return 0;
+		}
+		pr_err(KBUILD_MODNAME
+			": failed to find firmware file %s"
+			", aborting upload.\n", name);
+		return -EINVAL;
+	}
+	if (IS_ERR(img))
+		return PTR_ERR(img);
+
+	kl_histogram_sample_begin(&dev->totals.fw_upload);
+	start = ktime_get();
+
+	ret = hdcapm_dmawrite32_stream(dev, addr, (const u32 *)img->fw->data, len / sizeof(u32),
+		dev->sizing.ep2_chunk_dwords);
+
+	us = ktime_us_delta(ktime_get(), start);
+	hdcapm_fw_put(img);
+	if (ret < 0) {
+		pr_err(KBUILD_MODNAME ": upload of firmware %s failed, ret = %d\n", name, ret);
+		return ret;
+	}
+	kl_histogram_sample_complete(&dev->totals.fw_upload);
+
+	dev->totals.fw_upload_bytes += len;
+	dev->totals.fw_upload_us += us;
+	dprintk(1, "uploaded firmware %s, %zu bytes in %lld us\n", name, len, us);
+
+	return 0;
+}
+
+/* KB/s for bytes moved in us, 0 when the candidate failed. */
+static u32 calibrate_kbps(u64 bytes, s64 us, int ret)
+{
+	if (ret < 0 || us <= 0)
+		return 0;
+
+	return div_u64(div_u64(bytes * 1000000, 1024), us);
+}
+
+/* Time a few transfer sizes on each bulk endpoint and keep the fastest,
+ * what wins depends on the host controller and hub more than on us.
+ * EP2 writes land in the scratch area wiped straight afterwards.
+ * EP1 reads come from the code area, the split only changes how the
+ * payload is posted (see hdcapm_core_recv_payload), the firmware still
+ * produces the same dmaread. That split only exists on the pipelined
+ * dmaread path, so EP1 is skipped when pipelined_dmaread is off.
+ * Candidates are listed default first and only a strictly faster one
+ * replaces it.
+ */
+#define CALIBRATE_BYTES (512 * 1024)
+#define CALIBRATE_EP1_READ_DWORDS 0x4000
+static int hdcapm_compressor_calibrate(struct hdcapm_dev *dev)
+{
+	static const u32 ep1_sizes[HDCAPM_CALIBRATE_SIZES] = { 0, 16384, 8192, 4096 };
+	static const u32 ep2_sizes[HDCAPM_CALIBRATE_SIZES] = { 0x2000, 0x1000, 0x800, 0x400 };
+	struct hdcapm_xfer_sizing *s = &dev->sizing;
+	u32 best1 = 0, best2 = 0;
+	u32 *buf;
+	ktime_t start;
+	u32 i, j;
+	int ret;
+
+	buf = kzalloc(CALIBRATE_EP1_READ_DWORDS * sizeof(u32), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	for (i = 0; i < HDCAPM_CALIBRATE_SIZES; i++) {
+		s->ep2_candidates[i] = ep2_sizes[i];
+		ret = 0;
+		start = ktime_get();
+		for (j = 0; j < CALIBRATE_BYTES / (ep2_sizes[i] * sizeof(u32)) && ret == 0; j++)
+			ret = hdcapm_dmawrite32(dev, 0x0005634E, buf, ep2_sizes[i]);
+		s->ep2_kbps[i] = calibrate_kbps(CALIBRATE_BYTES, ktime_us_delta(ktime_get(), start), ret);
+		if (s->ep2_kbps[i] > s->ep2_kbps[best2])
+			best2 = i;
+	}
+
+	s->ep1_skipped = !hdcapm_core_pipelined_dmaread(dev);
+	for (i = 0; i < HDCAPM_CALIBRATE_SIZES && !s->ep1_skipped; i++) {
+		s->ep1_candidates[i] = ep1_sizes[i];
+		s->ep1_urb_bytes = ep1_sizes[i];
+		ret = 0;
+		start = ktime_get();
+		for (j = 0; j < CALIBRATE_BYTES / (CALIBRATE_EP1_READ_DWORDS * sizeof(u32)) && ret == 0; j++)
+			ret = hdcapm_dmaread32(dev, 0x00000000, buf, CALIBRATE_EP1_READ_DWORDS);
+		s->ep1_kbps[i] = calibrate_kbps(CALIBRATE_BYTES, ktime_us_delta(ktime_get(), start), ret);
+		if (s->ep1_kbps[i] > s->ep1_kbps[best1])
+			best1 = i;
+	}
+	kfree(buf);
+
+	/* Nothing worked, leave the defaults alone. */
+	if ((!s->ep1_skipped && s->ep1_kbps[best1] == 0) || s->ep2_kbps[best2] == 0) {
+		s->ep1_urb_bytes = ep1_sizes[0];
+		pr_err(KBUILD_MODNAME ": transfer size calibration failed, keeping defaults.\n");
+		return -EIO;
+	}
+
+	s->ep1_urb_bytes = ep1_sizes[best1];
+	s->ep2_chunk_dwords = ep2_sizes[best2];
+	s->calibrated = 1;
+
+	if (s->ep1_skipped)
+		pr_info(KBUILD_MODNAME ": calibrated EP2 chunk 0x%x dwords (%u KB/s), EP1 n/a without pipelined_dmaread\n",
+			s->ep2_chunk_dwords, s->ep2_kbps[best2]);
+	else
+		pr_info(KBUILD_MODNAME ": calibrated EP1 urb %u bytes (%u KB/s), EP2 chunk 0x%x dwords (%u KB/s)\n",
+			s->ep1_urb_bytes, s->ep1_kbps[best1], s->ep2_chunk_dwords, s->ep2_kbps[best2]);
+
+	return 0;
+}
+
+/* Device memory the bring-up clears before the firmware upload. */
+static const struct {
+	u32 addr;
+	u32 dwords;
+} wipe_regions[] = {
+	{ 0x0005634E, 0x2000 },
+	{ 0x0005834E, 0x2000 },
+	{ 0x0005A34E, 0x1E3B },
+};
+
+/* Fill a region on the device, then read back its first, middle and last DWORD. */
+static int fill_verify(struct hdcapm_dev *dev, u32 addr, u32 dwords, u32 val)
+{
+	u32 probe[] = { addr, addr + (dwords / 2), addr + dwords - 1 };
+	u32 v;
+	int i;
+
+	if (hdcapm_mem_fill32(dev, addr, dwords, val) < 0)
+		return -EIO;
+
+	for (i = 0; i < ARRAY_SIZE(probe); i++) {
+		if (hdcapm_mem_read32(dev, probe[i], &v) < 0)
+			return -EIO;
+		if (v != val)
+			return -EPROTO;
+	}
+
+	return 0;
+}
+
+/* Clear wipe_regions, with the firmware's fill command when it does ranges,
+ * else by streaming zeros over EP2. The first wipe on a device fills a
+ * canary and reads it back, memory that is already zero proves nothing.
+ */
+static int hdcapm_compressor_wipe(struct hdcapm_dev *dev)
+{
+	u32 *dwords;
+	int ret = 0;
+	int i;
+
+	if (dev->mem_fill == 0) {
+		dev->mem_fill = fill_verify(dev, wipe_regions[0].addr, wipe_regions[0].dwords, 0xa5a5a5a5) == 0 ? 1 : -1;
+		dprintk(1, "%s() device memory fill %s\n", __func__, dev->mem_fill > 0 ? "works" : "unsupported");
+	}
+
+	if (dev->mem_fill > 0) {
+		for (i = 0; i < ARRAY_SIZE(wipe_regions); i++) {
+			if (fill_verify(dev, wipe_regions[i].addr, wipe_regions[i].dwords, 0) < 0)
+				break;
+		}
+		if (i == ARRAY_SIZE(wipe_regions))
+			return 0;
+
+		pr_err(KBUILD_MODNAME ": device memory fill failed verification, streaming the wipe\n");
+		dev->mem_fill = -1;
+	}
+
+	dwords = kzalloc(0x2000 * sizeof(u32), GFP_KERNEL);
+	if (!dwords)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(wipe_regions); i++) {
+		if (hdcapm_dmawrite32(dev, wipe_regions[i].addr, dwords, wipe_regions[i].dwords) < 0) {
+			pr_err(KBUILD_MODNAME ": wipe of addr%d failed\n", i + 1);
+			ret = -EINVAL;
+			break;
+		}
+	}
+	kfree(dwords);
+
+	return ret;
+}
+
 int hdcapm_compressor_register(struct hdcapm_dev *dev)
 {
-	const struct firmware *fw = NULL;
 	const char *fw_video = "v4l-hdcapm-vidfw-01.fw";
 	size_t fw_video_len = 453684;
 	const char *fw_audio = "v4l-hdcapm-audfw-01.fw";
 	size_t fw_audio_len = 363832;
 	u32 val;
-	u32 *dwords;
-	u32 addr;
-	u32 chunk;
-	u32 cpy;
-	u32 offset;
 	int ret;
 
-	hdcapm_compressor_enable_firmware(dev, 0);
-
-// pl330b_lib_reinit
-	hdcapm_write32(dev, REG_081C, 0x00004000);
-	hdcapm_write32(dev, REG_0820, 0x00103FFF);
-	hdcapm_write32(dev, REG_0824, 0x00000000);
-
-	hdcapm_write32(dev, REG_0828, 0x00104000);
-	hdcapm_write32(dev, REG_082C, 0x00203FFF);
-	hdcapm_write32(dev, REG_0830, 0x00100000);
+	/* A firmware (re)load disturbs the GPIO block, don't trust the register shadows. */
+	hdcapm_shadow_invalidate(dev);
+	dev->fw_loaded = 0;
+	dev->armed = 0;
 
-	hdcapm_write32(dev, REG_0834, 0x00204000);
-	hdcapm_write32(dev, REG_0838, 0x00303FFF);
-	hdcapm_write32(dev, REG_083C, 0x00200000);
+	hdcapm_compressor_enable_firmware(dev, 0);
 
-	hdcapm_write32(dev, REG_0840, 0x70003124);
-	hdcapm_write32(dev, REG_0840, 0x90003124);
+	if (pl330b_lib_reinit(dev, 0) < 0) {
+		pr_err(KBUILD_MODNAME ": USB write failure, pl330b reinit failed, aborting.\n");
+		return -EINVAL;
+	}
 
 	/* Hardware ID? Only every read, never written */
 	if (hdcapm_read32(dev, REG_0038, &val) < 0) {
@@ -563,7 +1023,10 @@ int hdcapm_compressor_register(struct hdcapm_dev *dev)
 		return -EINVAL;
 	}
 	dprintk(1, "chiprev? [%08x = %08x]\n", REG_0038, val);
-	BUG_ON(val != 0x00010020);
+	if (val != 0x00010020) {
+		pr_err(KBUILD_MODNAME ": unexpected chip id 0x%08x, aborting.\n", val);
+		return -ENODEV;
+	}
 
 #if ONETIME_FW_LOAD
 	hdcapm_write32(dev, REG_GPIO_OE, 0x00000000);
@@ -575,27 +1038,24 @@ int hdcapm_compressor_register(struct hdcapm_dev *dev)
 	hdcapm_read32(dev, REG_0050, &val);
 
 	dprintk(1, "%08x = %08x\n", REG_0050, val);
-	BUG_ON(val != 0x00200400);
+	if (val != 0x00200400) {
+		pr_err(KBUILD_MODNAME ": output control readback 0x%08x failed, aborting.\n", val);
+		return -EIO;
+	}
 
-	/* Give the device enough time to boot its initial microcode. */
-	msleep(1000);
+	/* Give the device enough time to boot its initial microcode. Nothing we
+	 * can read tells us when that's done, the delay stays, but tunable.
+	 */
+	if (boot_delay)
+		msleep(boot_delay);
 
 	hdcapm_compressor_enable_firmware(dev, 0);
 
 	// 12570
-	hdcapm_write32(dev, REG_FW_CMD_BUSY, 0x00000000);
-	hdcapm_write32(dev, REG_081C, 0x00004000);
-
-	hdcapm_write32(dev, REG_0820, 0x00103FFF);
-	hdcapm_write32(dev, REG_0824, 0x00000000);
-	hdcapm_write32(dev, REG_0828, 0x00104000);
-	hdcapm_write32(dev, REG_082C, 0x00203FFF);
-	hdcapm_write32(dev, REG_0830, 0x00100000);
-	hdcapm_write32(dev, REG_0834, 0x00204000);
-	hdcapm_write32(dev, REG_0838, 0x00303FFF);
-	hdcapm_write32(dev, REG_083C, 0x00200000);
-	hdcapm_write32(dev, REG_0840, 0x70003124);
-	hdcapm_write32(dev, REG_0840, 0x90003124);
+	if (pl330b_lib_reinit(dev, 1) < 0) {
+		pr_err(KBUILD_MODNAME ": USB write failure, pl330b reinit failed, aborting.\n");
+		return -EINVAL;
+	}
 
 	// 17568
 	hdcapm_write32(dev, REG_0050, 0x00200406);
@@ -627,57 +1087,19 @@ int hdcapm_compressor_register(struct hdcapm_dev *dev)
 #endif
 	hdcapm_write32(dev, REG_0000, 0x03FF0300);
 
-	/* Wipe memory at various addresses */
-	dwords = kzalloc(0x2000 * sizeof(u32), GFP_KERNEL);
-	if (!dwords)
-		return -ENOMEM;
+	/* Failure isn't fatal, the defaults are what we always ran with. */
+	if (calibrate_xfer == 2 || (calibrate_xfer == 1 && !dev->sizing.calibrated))
+		hdcapm_compressor_calibrate(dev);
 
-	if (hdcapm_dmawrite32(dev, 0x0005634E, dwords, 0x2000) < 0) {
-		pr_err(KBUILD_MODNAME ": wipe of addr1 failed\n");
-		return -EINVAL;
-	}
-	if (hdcapm_dmawrite32(dev, 0x0005834E, dwords, 0x2000) < 0) {
-		pr_err(KBUILD_MODNAME ": wipe of addr2 failed\n");
-		return -EINVAL;
-	}
-	if (hdcapm_dmawrite32(dev, 0x0005A34E, dwords, 0x1E3B) < 0) {
-		pr_err(KBUILD_MODNAME ": wipe of addr3 failed\n");
-		return -EINVAL;
-	}
-	kfree(dwords);
+	/* Wipe memory at various addresses */
+	ret = hdcapm_compressor_wipe(dev);
+	if (ret < 0)
+		return ret;
 
 	/* Upload the audio firmware. */
-	ret = request_firmware(&fw, fw_audio, &dev->udev->dev);
-	if (ret) {
-		pr_err(KBUILD_MODNAME
-			": failed to find firmware file %s"
-			", aborting upload.\n", fw_video);
-		return -EINVAL;
-	}
-	if (fw->size != fw_audio_len) {
-		pr_err(KBUILD_MODNAME ": failed video firmware length check\n");
-		release_firmware(fw);
-		return -EINVAL;
-	}
-	pr_info(KBUILD_MODNAME ": loading audio firmware size %zu bytes.\n", fw->size);
-
-	offset = 0;
-	addr = 0x00040000;
-	val = fw_audio_len;
-	chunk = 0x2000 * sizeof(u32);
-	while (val > 0) {
-		if (val > chunk)
-			cpy = chunk;
-		else
-			cpy = val;
-
-		hdcapm_dmawrite32(dev, addr, (const u32 *)fw->data + offset, cpy / sizeof(u32));
-
-		val -= cpy;
-		addr += (cpy / sizeof(u32));
-		offset += (cpy / sizeof(u32));
-	}
-	release_firmware(fw);
+	ret = hdcapm_compressor_upload(dev, fw_audio, fw_audio_len, 0x00040000);
+	if (ret < 0)
+		return ret;
 
 	// 24757
 	hdcapm_mem_write32(dev, 0x000BC425, 1);
@@ -689,49 +1111,19 @@ int hdcapm_compressor_register(struct hdcapm_dev *dev)
 	hdcapm_write32(dev, REG_FW_CMD_BUSY, 0x00000000);
 
 	/* Upload the video firmware. */
-	ret = request_firmware(&fw, fw_video, &dev->udev->dev);
-	if (ret) {
-		pr_err(KBUILD_MODNAME
-			": failed to find firmware file %s"
-			", aborting upload.\n", fw_video);
-		return -EINVAL;
-	}
-	if (fw->size != fw_video_len) {
-		pr_err(KBUILD_MODNAME ": failed video firmware length check\n");
-		release_firmware(fw);
-		return -EINVAL;
-	}
-	pr_info(KBUILD_MODNAME ": loading video firmware size %zu bytes.\n", fw->size);
-
-	/* Load the video firmware */
 	// 24778
-	offset = 0;
-	addr = 0x00000000;
-	val = fw_video_len;
-	chunk = 0x2000 * sizeof(u32);
-	while (val > 0) {
-		if (val > chunk)
-			cpy = chunk;
-		else
-			cpy = val;
-
-		hdcapm_dmawrite32(dev, addr, (const u32 *)fw->data + offset, cpy / sizeof(u32));
-
-		val -= cpy;
-		addr += (cpy / sizeof(u32));
-		offset += (cpy / sizeof(u32));
-	}
-	release_firmware(fw);
+	ret = hdcapm_compressor_upload(dev, fw_video, fw_video_len, 0x00000000);
+	if (ret < 0)
+		return ret;
 
 	hdcapm_compressor_enable_firmware(dev, 1);
 	hdcapm_write32(dev, REG_FW_CMD_BUSY, 0x00000000);
 
-	// 38021
-	hdcapm_mem_read32(dev, 0x00000040, &val);
-#if 0
-	dprintk(1, "%s() val = 0x%x\n", __func__, val);
-	WARN_ON(val != 0x534f5351); /* QSOS */
-#endif
+	// 38021, 38037
+	kl_histogram_sample_begin(&dev->totals.fw_ready_wait);
+	if (!fw_wait_ready(dev, fw_ready_timeout))
+		pr_info(KBUILD_MODNAME ": firmware not ready after %dms, continuing\n", fw_ready_timeout);
+	kl_histogram_sample_complete(&dev->totals.fw_ready_wait);
 
 	hdcapm_mem_read32(dev, 0x00000041, &val);
 #if 0
@@ -739,19 +1131,14 @@ int hdcapm_compressor_register(struct hdcapm_dev *dev)
 	WARN_ON(val != 0x0002001e); /* ???? */
 #endif
 
-	// 38037
-	hdcapm_mem_read32(dev, 0x000Bc804, &val);
-#if 0
-	dprintk(1, "%s() val = 0x%x\n", __func__, val);
-	WARN_ON(val != 0); /* ???? */
-#endif
-
-	msleep(100);
+	hdcapm_shadow_invalidate(dev);
 
 #if ONETIME_FW_LOAD
 	hdcapm_compressor_init_gpios(dev);
 #endif
 
+	dev->fw_loaded = 1;
+
 	pr_info(KBUILD_MODNAME ": Registered compressor\n");
 	return 0;
 }
@@ -761,17 +1148,276 @@ void hdcapm_compressor_unregister(struct hdcapm_dev *dev)
 	dprintk(1, "%s() Unregistered compressor\n", __func__);
 }
 
+/* Enable or disable the audio and video outputs (bits 1/2). */
+static int hdcapm_compressor_outputs(struct hdcapm_dev *dev, int enable)
+{
+	u32 val;
+
+	if (hdcapm_read32(dev, REG_0050, &val) < 0)
+		return -EIO;
+
+	if (enable)
+		val &= ~((1 << 1) | (1 << 2));
+	else
+		val |= (1 << 1) | (1 << 2);
+
+	return hdcapm_write32(dev, REG_0050, val);
+}
+
+/* Recovery step 2. Wait for any command we had in flight to retire and
+ * make sure the TS descriptor the firmware is offering makes sense,
+ * dropping it if it doesn't, so the next usb_read() starts clean.
+ */
+static int hdcapm_compressor_resync(struct hdcapm_dev *dev)
+{
+	u32 arr[7];
+	int ret;
+
+	mutex_lock(&dev->lock);
+	ret = fw_check_idle(dev);
+	mutex_unlock(&dev->lock);
+	if (ret <= 0) {
+		pr_err(KBUILD_MODNAME ": resync, firmware command interface stuck busy\n");
+		return -EIO;
+	}
+
+	if (hdcapm_read32_array(dev, REG_06B0, ARRAY_SIZE(arr), &arr[0], 1) < 0)
+		return -EIO;
+
+	if (arr[6] == 0 || tsb_check(arr) == 0)
+		return 0;
+
+	/* Discard the bogus descriptor and check the firmware replaced it. */
+	if (hdcapm_write32(dev, 0x6c8, 0) < 0)
+		return -EIO;
+
+	if (hdcapm_read32_array(dev, REG_06B0, ARRAY_SIZE(arr), &arr[0], 1) < 0)
+		return -EIO;
+
+	if (arr[6] != 0 && tsb_check(arr) < 0)
+		return -EPROTO;
+
+	return 0;
+}
+
+/* Recovery step 3. Reset the USB port and bring the codec back up from scratch. */
+static int hdcapm_compressor_restart(struct hdcapm_dev *dev, struct v4l2_dv_timings *timings)
+{
+	if (hdcapm_core_port_reset(dev) < 0)
+		return -EIO;
+
+	if (hdcapm_compressor_register(dev) < 0)
+		return -EIO;
+
+	/* The reset and the firmware load disturbed the GPIOs, the
+	 * MST3367 went into reset with them.
+	 */
+	hdcapm_compressor_init_gpios(dev);
+	v4l2_subdev_call(dev->sd, core, s_power, 1);
+
+	if (hdcapm_compressor_outputs(dev, 1) < 0)
+		return -EIO;
+
+	return firmware_transition(dev, 1, timings);
+}
+
+/* Bring the resident firmware back for another capture. The codec itself
+ * survives a stop, it's the audio DSP that comes back silent, so
+ * rerun only its post upload init from hdcapm_compressor_register().
+ */
+static int hdcapm_compressor_warm(struct hdcapm_dev *dev)
+{
+	if (hdcapm_mem_write32(dev, 0x000BC425, 1) < 0 ||
+		hdcapm_mem_write32(dev, 0x000BC424, 0) < 0 ||
+		hdcapm_mem_write32(dev, 0x000BC801, 0) < 0)
+		return -EIO;
+
+	if (hdcapm_write32(dev, REG_FW_CMD_BUSY, 0x00000000) < 0)
+		return -EIO;
+
+	dprintk(1, "%s() warm restart\n", __func__);
+	return 0;
+}
+
+/* A warm start came up without audio, do the full firmware reload it skipped. */
+static int hdcapm_compressor_reload(struct hdcapm_dev *dev, struct v4l2_dv_timings *timings)
+{
+	firmware_transition(dev, 0, NULL);
+
+	if (hdcapm_compressor_register(dev) < 0)
+		return -EIO;
+
+	hdcapm_compressor_init_gpios(dev);
+	v4l2_subdev_call(dev->sd, core, s_power, 1);
+
+	if (hdcapm_compressor_outputs(dev, 1) < 0)
+		return -EIO;
+
+	return firmware_transition(dev, 1, timings);
+}
+
+/* Recover from a usb_read() failure, escalating only as far as needed:
+ * 1. (transport errors) clear endpoint halts, done if the status block reads back sane.
+ * 2. resync with the firmware status registers.
+ * 3. USB port reset and firmware reload.
+ * Returns 0 when streaming can resume.
+ */
+static int hdcapm_compressor_recover(struct hdcapm_dev *dev, int err, struct v4l2_dv_timings *timings)
+{
+	u32 arr[7];
+
+	if (err == -EIO) {
+		dev->stats->recover_clear_halt++;
+		if (hdcapm_core_clear_halts(dev) == 0 &&
+			hdcapm_read32_array(dev, REG_06B0, ARRAY_SIZE(arr), &arr[0], 1) == 0 &&
+			(arr[6] == 0 || tsb_check(arr) == 0))
+			return 0;
+	}
+
+	dev->stats->recover_resync++;
+	if (hdcapm_compressor_resync(dev) == 0)
+		return 0;
+
+	dev->stats->recover_reset++;
+	pr_err(KBUILD_MODNAME ": transport unrecoverable, resetting device\n");
+	if (hdcapm_compressor_restart(dev, timings) == 0)
+		return 0;
+
+	dev->stats->recover_failed++;
+	return -EIO;
+}
+
+/* Get the codec firmware running, through a warm restart when warm_restart
+ * allows it, else a full upload.
+ * Returns 1 after a warm restart, 0 after a full load, < 0 on error.
+ */
+static int hdcapm_compressor_load(struct hdcapm_dev *dev)
+{
+#if !(ONETIME_FW_LOAD)
+	if (warm_restart && dev->fw_loaded && !dev->warm_failed && hdcapm_compressor_warm(dev) == 0)
+		return 1;
+
+	/* Register the compression codec (it does both audio and video). */
+	if (hdcapm_compressor_register(dev) < 0) {
+		pr_err(KBUILD_MODNAME ": failed to register compressor\n");
+		return -EIO;
+	}
+#endif
+	return 0;
+}
+
+/* Leave the codec, GPIOs and receiver the way a capture stop always has. */
+static void hdcapm_compressor_teardown(struct hdcapm_dev *dev)
+{
+#if !(ONETIME_FW_LOAD)
+	hdcapm_compressor_unregister(dev);
+	hdcapm_compressor_init_gpios(dev);
+
+	/* Reloading the firmware disturbs the GPIOs and
+	 * causes the MST3367 to go into reset.
+	 * Be kind, tell the HDMI receiver to
+	 * reconfigure itself.
+	 */
+	v4l2_subdev_call(dev->sd, core, s_power, 1);
+#endif
+}
+
+/* Stop the encoder and tear the codec down after a capture. */
+static void hdcapm_compressor_halt(struct hdcapm_dev *dev)
+{
+	/* Disable audio and video outputs. */
+	hdcapm_compressor_outputs(dev, 0);
+
+	firmware_transition(dev, 0, NULL);
+
+	hdcapm_compressor_teardown(dev);
+}
+
+/* Drop a pre-armed encoder that was never started. It is configured but
+ * not encoding, so the stop script has nothing to stop, skip it and only
+ * tear the codec down.
+ */
+static void hdcapm_compressor_disarm(struct hdcapm_dev *dev)
+{
+	hdcapm_compressor_outputs(dev, 0);
+	dev->armed = 0;
+
+	hdcapm_compressor_teardown(dev);
+}
+
+/* Pre-arm: load the firmware and configure the encoder while nobody is
+ * waiting on it, so the first read only pays for the start command.
+ * Same order as a cold start in hdcapm_compressor_run(), the outputs are
+ * enabled before the encoder is configured.
+ */
+static int hdcapm_compressor_arm(struct hdcapm_dev *dev)
+{
+	int ret;
+
+	ret = hdcapm_compressor_load(dev);
+	if (ret < 0)
+		return ret;
+	dev->armed_warm = ret;
+
+	/* Enable audio and video outputs. */
+	ret = hdcapm_compressor_outputs(dev, 1);
+	if (ret < 0)
+		return ret;
+
+	ret = firmware_configure(dev);
+	if (ret < 0)
+		return ret;
+
+	dev->armed = 1;
+	dev->armed_expires = jiffies + msecs_to_jiffies(prearm_timeout);
+	dprintk(1, "%s() encoder armed%s\n", __func__, dev->armed_warm ? " (warm)" : "");
+
+	return 0;
+}
+
+/* Called by the thread while no capture runs. Arms the encoder once per
+ * first open as prearm asks, and tears it back down after prearm_timeout,
+ * on the last close or when prearm is switched off.
+ */
+void hdcapm_compressor_idle(struct hdcapm_dev *dev, int locked)
+{
+	if (dev->armed) {
+		if (!prearm || atomic_read(&dev->users) == 0 ||
+			(prearm_timeout && time_after(jiffies, dev->armed_expires))) {
+			dprintk(1, "%s() disarming encoder\n", __func__);
+			hdcapm_compressor_disarm(dev);
+			dev->prearm_spent = 1;
+		}
+		return;
+	}
+
+	if (!prearm || dev->prearm_spent || atomic_read(&dev->users) == 0)
+		return;
+
+	/* Mode 2 waits for the receiver to lock. */
+	if (prearm == 2 && !locked)
+		return;
+
+	dev->prearm_spent = 1;
+	if (hdcapm_compressor_arm(dev) < 0)
+		pr_err(KBUILD_MODNAME ": failed to pre-arm the encoder\n");
+}
+
 void hdcapm_compressor_run(struct hdcapm_dev *dev)
 {
 	struct v4l2_dv_timings timings;
+	struct v4l2_dv_timings now;
+	unsigned long interrupted = 0;
+	unsigned long next_poll;
+	unsigned long warm_deadline = 0;
+	u64 resets = 0; /* recover_reset at the last good buffer */
 	int ret;
-	int val;
 
 	printk("%s()\n", __func__);
 
 	if (v4l2_subdev_call(dev->sd, video, g_dv_timings, &timings) < 0) {
 		pr_err("%s() subdev call failed\n", __func__);
-		dev->state = STATE_STOPPED;
+		hdcapm_core_streaming_stopped(dev);
 		return;
 	}
 
@@ -781,51 +1427,115 @@ void hdcapm_compressor_run(struct hdcapm_dev *dev)
 	/* Make sure all of our buffers are available again. */
 	hdcapm_buffers_move_all(dev, &dev->list_buf_free, &dev->list_buf_used);
 
-#if !(ONETIME_FW_LOAD)
-	/* Register the compression codec (it does both audio and video). */
-	if (hdcapm_compressor_register(dev) < 0) {
-		pr_err(KBUILD_MODNAME ": failed to register compressor\n");
-		return;
+	dev->audio_seen = 0;
+
+	/* Bring up through to the encoder start command. */
+	kl_histogram_sample_begin(&dev->totals.compressor_start);
+
+	/* A pre-armed encoder has its firmware up and configured already. */
+	if (dev->armed) {
+		dev->totals.prearm_starts++;
+		ret = dev->armed_warm;
+	} else {
+		ret = hdcapm_compressor_load(dev);
+		if (ret < 0) {
+			hdcapm_core_streaming_stopped(dev);
+			return;
+		}
 	}
-#endif
+	if (ret > 0) {
+		dev->totals.warm_starts++;
+		dev->sessions[dev->session_seq & (HDCAPM_SESSIONS - 1)].warm = 1;
+		warm_deadline = jiffies + msecs_to_jiffies(WARM_AUDIO_TIMEOUT_MS);
+	}
+	hdcapm_core_session_mark(dev, HDCAPM_PHASE_FW_LOADED);
 
-	/* Enable audio and video outputs. */
-	hdcapm_read32(dev, REG_0050, &val);
-	val &= ~(1 << 1);
-	val &= ~(1 << 2);
-	hdcapm_write32(dev, REG_0050, val);
+	/* Enable audio and video outputs, a pre-armed encoder did so before configuring. */
+	if (!dev->armed)
+		hdcapm_compressor_outputs(dev, 1);
 
 	ret = firmware_transition(dev, 1, &timings);
+	if (ret < 0) {
+		/* Whatever a warm or pre-armed start left behind can't be trusted, reload it all. */
+		pr_err(KBUILD_MODNAME ": encoder start failed, ret = %d, reloading the firmware\n", ret);
+		dev->armed = 0;
+		dev->fw_loaded = 0;
+		if (warm_deadline) {
+			warm_deadline = 0;
+			dev->warm_failed = 1;
+			dev->totals.warm_fallbacks++;
+		}
+		ret = hdcapm_compressor_reload(dev, &timings);
+	}
+	kl_histogram_sample_complete(&dev->totals.compressor_start);
+
+	if (ret < 0) {
+		/* Skips the capture loop, the halt below still tears it down. */
+		pr_err(KBUILD_MODNAME ": encoder failed to start, stopping\n");
+		hdcapm_core_streaming_abort(dev);
+	} else
+		hdcapm_core_session_mark(dev, HDCAPM_PHASE_ENCODER_STARTED);
 
-	dev->state = STATE_STARTED;
+	/* A stop that came in during the bring up skips the capture loop. */
+	hdcapm_core_streaming_started(dev);
+	next_poll = jiffies + msecs_to_jiffies(signal_poll_interval);
 	while (dev->state == STATE_STARTED) {
 		ret = usb_read(dev);
-		kl_histogram_sample_begin(&dev->stats->usb_read_sleeping);
-		usleep_range(500, 4000);
-		kl_histogram_sample_complete(&dev->stats->usb_read_sleeping);
-	}
+		if (ret == 0 && interrupted) {
+			/* First buffer since a failure, how long were we out? */
+			kl_histogram_update_with_value(&dev->stats->capture_interrupted,
+				jiffies_to_msecs(jiffies - interrupted));
+			interrupted = 0;
+			resets = dev->stats->recover_reset;
+		} else
+		if (ret == -EIO || ret == -EPROTO) {
+			if (!interrupted)
+				interrupted = jiffies;
+
+			/* Resets that don't get a single buffer through aren't helping. */
+			if (dev->stats->recover_reset - resets > 3 ||
+				hdcapm_compressor_recover(dev, ret, &timings) < 0) {
+				pr_err(KBUILD_MODNAME ": capture failed, stopping\n");
+				hdcapm_core_streaming_abort(dev);
+				break;
+			}
+		}
 
-	/* Disable audio and video outputs. */
-        hdcapm_read32(dev, REG_0050, &val);
-        val |= (1 << 1);
-        val |= (1 << 2);
-        hdcapm_write32(dev, REG_0050, val);
+		/* A warm start has to prove the audio DSP came back, or pay for the reload. */
+		if (warm_deadline && dev->audio_seen) {
+			warm_deadline = 0;
+		} else
+		if (warm_deadline && time_after(jiffies, warm_deadline)) {
+			warm_deadline = 0;
+			dev->warm_failed = 1;
+			dev->totals.warm_fallbacks++;
+			pr_info(KBUILD_MODNAME ": no audio after a warm restart, reloading the firmware\n");
+			if (hdcapm_compressor_reload(dev, &timings) < 0) {
+				pr_err(KBUILD_MODNAME ": firmware reload failed, stopping\n");
+				hdcapm_core_streaming_abort(dev);
+				break;
+			}
+		}
 
-	ret = firmware_transition(dev, 0, NULL);
+		/* Keep watching the source, the receiver raises V4L2_EVENT_SOURCE_CHANGE
+		 * on loss or a timing change. Its I2C traffic yields to the TS drain.
+		 */
+		if (signal_poll_interval && time_after(jiffies, next_poll)) {
+			v4l2_subdev_call(dev->sd, video, query_dv_timings, &now);
+			next_poll = jiffies + msecs_to_jiffies(signal_poll_interval);
+		}
 
-#if !(ONETIME_FW_LOAD)
-	hdcapm_compressor_unregister(dev);
-	hdcapm_compressor_init_gpios(dev);
+		hdcapm_core_linger(dev);
 
-	/* Reloading the firmware disturbs the GPIOs and
-	 * causes the MST3367 to go into reset.
-	 * Be kind, tell the HDMI receiver to
-	 * reconfigure itself.
-	 */
-	v4l2_subdev_call(dev->sd, core, s_power, 1);
-#endif
+		kl_histogram_sample_begin(&dev->stats->usb_read_sleeping);
+		usleep_range(500, 4000);
+		kl_histogram_sample_complete(&dev->stats->usb_read_sleeping);
+	}
 
-	dev->state = STATE_STOPPED;
+	hdcapm_compressor_halt(dev);
 
 	hdcapm_buffers_move_all(dev, &dev->list_buf_free, &dev->list_buf_used);
+
+	/* Lets a queued start or a waiting open in. */
+	hdcapm_core_streaming_stopped(dev);
 }
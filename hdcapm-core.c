@@ -30,6 +30,14 @@ unsigned int thread_poll_interval = 500;
 module_param(thread_poll_interval, int, 0644);
 MODULE_PARM_DESC(thread_poll_interval, "have the kernel thread poll every N ms (def:500)");
 
+static int autosuspend_delay = 2000;
+module_param(autosuspend_delay, int, 0444);
+MODULE_PARM_DESC(autosuspend_delay, "autosuspend N ms after the last close, -1 = leave it to userspace (def:2000)");
+
+static unsigned int linger = 0;
+module_param(linger, int, 0644);
+MODULE_PARM_DESC(linger, "keep the encoder running N seconds after the last reader goes, for a quick restart (def:0)");
+
 unsigned int buffer_count = 128;
 module_param(buffer_count, int, 0644);
 MODULE_PARM_DESC(buffer_count, "# of buffers the driver should queue");
@@ -39,84 +47,467 @@ unsigned int buffer_size = XFERBUF_SIZE;
 module_param(buffer_size, int, 0644);
 MODULE_PARM_DESC(buffer_size, "size of each buffer in bytes");
 
+static unsigned int reg_shadow = 1;
+module_param(reg_shadow, int, 0644);
+MODULE_PARM_DESC(reg_shadow, "shadow driver owned GPIO registers, skipping USB reads in RMW helpers (def:1)");
+
+static unsigned int pipelined_dmaread = 1;
+module_param(pipelined_dmaread, int, 0644);
+MODULE_PARM_DESC(pipelined_dmaread, "post the EP3 ack and EP1 payload reads before the dmaread command (def:1)");
+
 static DEFINE_MUTEX(devlist);
 LIST_HEAD(hdcapm_devlist);
 static unsigned int devlist_count;
 
-/* Copy an on-stack transfer buffer into a device context.
+/* Only kmalloc'd linear map memory (hdcapm_buffer payload, wipe buffers)
+ * can be handed to the host controller as is. Anything else has
+ * to bounce through a dev->xferpool buffer: stack, vmalloc (firmware
+ * images), module .data/.rodata and the kernel image. virt_addr_valid()
+ * alone accepts the kernel image on x86_64, so that is excluded by range.
+ */
+static int hdcapm_core_dma_capable(const void *buf)
+{
+	unsigned long addr = (unsigned long)buf;
+
+	if (is_vmalloc_or_module_addr(buf) || object_is_on_stack(buf))
+		return 0;
+	if (addr >= (unsigned long)_text && addr < (unsigned long)_end)
+		return 0;
+
+	return virt_addr_valid(buf);
+}
+
+static int hdcapm_core_xferpool_alloc(struct hdcapm_dev *dev)
+{
+	struct hdcapm_xferbuf *xb;
+	int i;
+
+	spin_lock_init(&dev->xferpool_lock);
+	init_waitqueue_head(&dev->xferpool_wait);
+
+	for (i = 0; i < HDCAPM_XFERPOOL_COUNT; i++) {
+		xb = &dev->xferpool[i];
+		xb->size = i < HDCAPM_XFERPOOL_SMALL ? HDCAPM_XFERPOOL_SMALL_SIZE : XFERBUF_SIZE;
+		xb->busy = 0;
+		xb->ptr = kzalloc(xb->size, GFP_KERNEL);
+		if (!xb->ptr)
+			return -ENOMEM;
+	}
+
+	return 0; /* Success */
+}
+
+static void hdcapm_core_xferpool_free(struct hdcapm_dev *dev)
+{
+	int i;
+
+	for (i = 0; i < HDCAPM_XFERPOOL_COUNT; i++) {
+		kfree(dev->xferpool[i].ptr);
+		dev->xferpool[i].ptr = NULL;
+	}
+}
+
+/* Claim the smallest idle pool buffer that fits len, the caller must hold xferpool_lock. */
+static struct hdcapm_xferbuf *hdcapm_core_xferpool_find(struct hdcapm_dev *dev, u32 len)
+{
+	struct hdcapm_xferbuf *xb;
+	int i;
+
+	for (i = 0; i < HDCAPM_XFERPOOL_COUNT; i++) {
+		xb = &dev->xferpool[i];
+		if (!xb->busy && xb->size >= len) {
+			xb->busy = 1;
+			return xb;
+		}
+	}
+
+	return NULL;
+}
+
+/* Borrow a bounce buffer of at least len bytes, sleeping while they're all in use. */
+static struct hdcapm_xferbuf *hdcapm_core_xferpool_get(struct hdcapm_dev *dev, u32 len)
+{
+	struct hdcapm_xferbuf *xb = NULL;
+	unsigned long start;
+
+	if (len > XFERBUF_SIZE) {
+		printk(KERN_ERR "%s() buffer of %d bytes too large for transfer\n", __func__, len);
+		return NULL;
+	}
+
+	spin_lock(&dev->xferpool_lock);
+	xb = hdcapm_core_xferpool_find(dev, len);
+	spin_unlock(&dev->xferpool_lock);
+	if (xb)
+		return xb;
+
+	start = jiffies;
+	wait_event(dev->xferpool_wait, ({
+		spin_lock(&dev->xferpool_lock);
+		xb = hdcapm_core_xferpool_find(dev, len);
+		spin_unlock(&dev->xferpool_lock);
+		xb != NULL; }));
+
+	spin_lock(&dev->xferpool_lock);
+	dev->stats->xferpool_contention++;
+	kl_histogram_update_with_value(&dev->stats->xferpool_wait, jiffies_to_msecs(jiffies - start));
+	spin_unlock(&dev->xferpool_lock);
+
+	return xb;
+}
+
+static void hdcapm_core_xferpool_put(struct hdcapm_dev *dev, struct hdcapm_xferbuf *xb)
+{
+	spin_lock(&dev->xferpool_lock);
+	xb->busy = 0;
+	spin_unlock(&dev->xferpool_lock);
+
+	wake_up(&dev->xferpool_wait);
+}
+
+/* Take the wire if it's free and no higher priority class is queued for it.
+ * A waiter leaves the queue in the same step it takes ownership.
+ */
+static int hdcapm_core_usb_trylock(struct hdcapm_dev *dev, int class, int waiter)
+{
+	struct hdcapm_sched *s = &dev->sched;
+	int ret = 0;
+	int i;
+
+	spin_lock(&s->lock);
+	if (s->owner == NULL) {
+		for (i = 0; i < class; i++) {
+			if (s->waiting[i])
+				break;
+		}
+		if (i == class) {
+			s->owner = current;
+			s->depth = 1;
+			if (waiter)
+				s->waiting[class]--;
+			ret = 1;
+		}
+	}
+	spin_unlock(&s->lock);
+
+	return ret;
+}
+
+/* Own the wire for a complete transaction (command, ack, payload).
+ * When the wire frees up, the highest priority waiting class goes next:
+ * TS drain beats firmware commands, which beat I2C. Within a class waiters
+ * race. The owner may re-enter, so a usb_read() holding HDCAPM_SCHED_DATA
+ * can call the register helpers that lock on their own.
+ */
+void hdcapm_core_usb_lock_class(struct hdcapm_dev *dev, int class)
+{
+	struct hdcapm_sched *s = &dev->sched;
+	unsigned long start;
+
+	spin_lock(&s->lock);
+	if (s->owner == current) {
+		s->depth++;
+		spin_unlock(&s->lock);
+		return;
+	}
+	spin_unlock(&s->lock);
+
+	if (hdcapm_core_usb_trylock(dev, class, 0))
+		return;
+
+	start = jiffies;
+	spin_lock(&s->lock);
+	s->waiting[class]++;
+	spin_unlock(&s->lock);
+
+	wait_event(s->wait, hdcapm_core_usb_trylock(dev, class, 1));
+
+	/* Stats are serialized by owning the wire. */
+	dev->stats->sched_contention[class]++;
+	kl_histogram_update_with_value(&dev->stats->sched_wait[class], jiffies_to_msecs(jiffies - start));
+}
+
+void hdcapm_core_usb_lock(struct hdcapm_dev *dev)
+{
+	hdcapm_core_usb_lock_class(dev, HDCAPM_SCHED_FW);
+}
+
+void hdcapm_core_usb_unlock(struct hdcapm_dev *dev)
+{
+	struct hdcapm_sched *s = &dev->sched;
+	int release;
+
+	spin_lock(&s->lock);
+	WARN_ON(s->owner != current);
+	release = --s->depth == 0;
+	if (release)
+		s->owner = NULL;
+	spin_unlock(&s->lock);
+
+	if (release)
+		wake_up_all(&s->wait);
+}
+
+/* Send a buffer to an OUT endpoint, zero copy when the buffer is DMA capable.
+ * Otherwise copy the transfer buffer into a pool buffer.
  * Do this before we pass it to the USB subsystem, else ARM complains (once) in the
  * USB controller about the location of the transfer.
- * TODO: Review usage and optimize of the calls so that not all transfers need to be on stack.
+ * This is a synchronous wrapper around the async URB engine in -urb.c.
  */
 int hdcapm_core_ep_send(struct hdcapm_dev *dev, int endpoint, u8 *buf, u32 len, u32 timeout)
 {
-	int writelength;
+	struct hdcapm_urb_ctx ctx;
+	struct hdcapm_xferbuf *xb;
+	int ret;
 
-	if (len > XFERBUF_SIZE) {
-		printk(KERN_ERR "%s() buffer of %d bytes too large for transfer\n", __func__, len);
-		return -1;
+	hdcapm_urb_ctx_init(dev, &ctx);
+
+	if (hdcapm_core_dma_capable(buf)) {
+		hdcapm_urb_send(&ctx, endpoint, buf, len);
+		return hdcapm_urb_wait(&ctx, timeout);
 	}
 
-	memcpy(dev->xferbuf, buf, len);
-	dev->xferbuf_len = len;
+	xb = hdcapm_core_xferpool_get(dev, len);
+	if (!xb)
+		return -EMSGSIZE;
+
+	memcpy(xb->ptr, buf, len);
 
 	/* Flush this to EP4 via a bulk write. */
-	return usb_bulk_msg(dev->udev, usb_sndbulkpipe(dev->udev, endpoint), dev->xferbuf, dev->xferbuf_len, &writelength, timeout);
+	hdcapm_urb_send(&ctx, endpoint, xb->ptr, len);
+	ret = hdcapm_urb_wait(&ctx, timeout);
+
+	hdcapm_core_xferpool_put(dev, xb);
+
+	return ret;
 }
 
-/* Copy a transfer buffer from the device context back to an onstack location.
- * TODO: Review usage and optimize of the calls so that not all transfers need to be on stack.
+/* Receive from an IN endpoint, landing directly in buf when it's DMA capable.
+ * Otherwise copy a pool buffer back to an onstack location.
+ * This is a synchronous wrapper around the async URB engine in -urb.c.
  */
 int hdcapm_core_ep_recv(struct hdcapm_dev *dev, int endpoint, u8 *buf, u32 len, u32 *actual, u32 timeout)
 {
+	struct hdcapm_urb_ctx ctx;
+	struct hdcapm_xferbuf *xb;
+	u32 xferlen = 0;
 	int ret;
 
-	BUG_ON(len > XFERBUF_SIZE);
+	hdcapm_urb_ctx_init(dev, &ctx);
+
+	if (hdcapm_core_dma_capable(buf)) {
+		*actual = 0;
+		hdcapm_urb_recv(&ctx, endpoint, buf, len, actual);
+		return hdcapm_urb_wait(&ctx, timeout);
+	}
+
+	xb = hdcapm_core_xferpool_get(dev, len);
+	if (!xb)
+		return -EMSGSIZE;
 
 	/* Bulk read */
-	ret = usb_bulk_msg(dev->udev, usb_rcvbulkpipe(dev->udev, endpoint), dev->xferbuf, len, &dev->xferbuf_len, timeout);
+	hdcapm_urb_recv(&ctx, endpoint, xb->ptr, len, &xferlen);
+	ret = hdcapm_urb_wait(&ctx, timeout);
+
+	memcpy(buf, xb->ptr, xferlen);
+	*actual = xferlen;
 
-	memcpy(buf, dev->xferbuf, dev->xferbuf_len);
-	*actual = dev->xferbuf_len;
+	hdcapm_core_xferpool_put(dev, xb);
 
 	return ret;
 }
 
-int hdcapm_mem_write32(struct hdcapm_dev *dev, u32 addr, u32 val)
+/* Queue an EP4 command and the EP3 reply together, then wait once. The
+ * reply IN transfer is already posted when the command goes out, so the
+ * host controller collects it as soon as the firmware answers.
+ */
+static int __hdcapm_core_ep_command(struct hdcapm_dev *dev, const u8 *tx, u32 txlen, u8 *rx, u32 rxlen, u32 *actual, u32 timeout)
 {
+	struct hdcapm_urb_ctx send, recv;
+	int ret;
+
+	/* Separate contexts, so a failed command doesn't leave us waiting
+	 * out the timeout on a reply that will never come.
+	 */
+	hdcapm_urb_ctx_init(dev, &send);
+	hdcapm_urb_ctx_init(dev, &recv);
+
+	hdcapm_urb_send_copy(&send, PIPE_EP4, tx, txlen);
+	if (rx) {
+		if (actual)
+			*actual = 0;
+		hdcapm_urb_recv_copy(&recv, PIPE_EP3, rx, rxlen, actual);
+	}
+
+	ret = hdcapm_urb_wait(&send, timeout);
+	if (ret < 0) {
+		hdcapm_urb_cancel(&recv);
+		hdcapm_urb_wait(&recv, 0);
+		return ret;
+	}
+
+	return hdcapm_urb_wait(&recv, timeout);
+}
+
+/* As above, owning the wire for the duration. */
+static int hdcapm_core_ep_command(struct hdcapm_dev *dev, const u8 *tx, u32 txlen, u8 *rx, u32 rxlen, u32 *actual, u32 timeout)
+{
+	int ret;
+
+	hdcapm_core_usb_lock(dev);
+	ret = __hdcapm_core_ep_command(dev, tx, txlen, rx, rxlen, actual, timeout);
+	hdcapm_core_usb_unlock(dev);
+
+	return ret;
+}
+
+/* Write-through shadow cache for registers the driver owns exclusively
+ * (GPIO output enable and data). hdcapm_set32/clr32 use the cached value
+ * and skip the USB read, every write still goes to the hardware.
+ * Anything that resets the device behind our back (firmware reload,
+ * resume) must call hdcapm_shadow_invalidate().
+ */
+static struct hdcapm_shadow_reg *hdcapm_shadow_find(struct hdcapm_dev *dev, u32 addr)
+{
+	int i;
+
+	for (i = 0; i < dev->shadow_count; i++) {
+		if (dev->shadow[i].addr == addr)
+			return &dev->shadow[i];
+	}
+
+	return NULL;
+}
+
+/* Opt a register into shadowing. The first RMW reads it from the hardware. */
+int hdcapm_shadow_enable(struct hdcapm_dev *dev, u32 addr)
+{
+	struct hdcapm_shadow_reg *reg;
+	unsigned long flags;
+	int ret = 0;
+
+	if (!reg_shadow)
+		return 0;
+
+	spin_lock_irqsave(&dev->shadow_lock, flags);
+	if (hdcapm_shadow_find(dev, addr) == NULL) {
+		if (dev->shadow_count < HDCAPM_SHADOW_REGS) {
+			reg = &dev->shadow[dev->shadow_count++];
+			reg->addr = addr;
+			reg->val = 0;
+			reg->valid = 0;
+		} else
+			ret = -ENOSPC;
+	}
+	spin_unlock_irqrestore(&dev->shadow_lock, flags);
+
+	return ret;
+}
+
+void hdcapm_shadow_invalidate(struct hdcapm_dev *dev)
+{
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&dev->shadow_lock, flags);
+	for (i = 0; i < dev->shadow_count; i++)
+		dev->shadow[i].valid = 0;
+	spin_unlock_irqrestore(&dev->shadow_lock, flags);
+}
+
+static void hdcapm_shadow_update(struct hdcapm_dev *dev, u32 addr, u32 val, int valid)
+{
+	struct hdcapm_shadow_reg *reg;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->shadow_lock, flags);
+	reg = hdcapm_shadow_find(dev, addr);
+	if (reg) {
+		reg->val = val;
+		reg->valid = valid;
+	}
+	spin_unlock_irqrestore(&dev->shadow_lock, flags);
+}
+
+/* Fetch the current register value for a read-modify-write, from the shadow when we can. */
+static int hdcapm_shadow_read32(struct hdcapm_dev *dev, u32 addr, u32 *val)
+{
+	struct hdcapm_shadow_reg *reg;
+	unsigned long flags;
+	int hit = 0, shadowed = 0;
+
+	spin_lock_irqsave(&dev->shadow_lock, flags);
+	reg = hdcapm_shadow_find(dev, addr);
+	if (reg) {
+		shadowed = 1;
+		if (reg->valid) {
+			*val = reg->val;
+			hit = 1;
+		}
+	}
+	spin_unlock_irqrestore(&dev->shadow_lock, flags);
+
+	if (hit) {
+		dev->stats->shadow_hits++;
+		return 0;
+	}
+
+	if (shadowed)
+		dev->stats->shadow_misses++;
+
+	return hdcapm_read32(dev, addr, val);
+}
+
+/* Fill entries DWORDS of device memory from addr with val. The memory write
+ * command carries a start and an (inclusive) end address, whether the
+ * firmware honours a range is only known by reading it back, see
+ * hdcapm_compressor_wipe().
+ */
+int hdcapm_mem_fill32(struct hdcapm_dev *dev, u32 addr, u32 entries, u32 val)
+{
+	u32 end = addr + entries - 1;
+
 	/* EP4 Host -> 02 01 04 00 01 C8 0B 00 01 C8 0B 00 00 00 00 00 */
 	u8 tx[] = {
 		0x02,
 		0x01, /* Write */
 		0x04,
 		0x00,
-		addr, /* This is really a fill function? */
-		addr >>  8,
-		addr >> 16,
-		addr >> 24,
 		addr,
 		addr >>  8,
 		addr >> 16,
 		addr >> 24,
+		end,
+		end >>  8,
+		end >> 16,
+		end >> 24,
 		val,
 		val >>  8,
 		val >> 16,
 		val >> 24,
 	};
 
-	dprintk(2, "%s(0x%08x, 0x%08x)\n", __func__, addr, val);
+	if (entries == 0)
+		return -EINVAL;
+
+	dprintk(2, "%s(0x%08x, 0x%08x, 0x%08x)\n", __func__, addr, entries, val);
 
-	if (hdcapm_core_ep_send(dev, PIPE_EP4, &tx[0], sizeof(tx), 500) < 0) {
-		return -1;
+	if (hdcapm_core_ep_command(dev, &tx[0], sizeof(tx), NULL, 0, NULL, 500) < 0) {
+		return -EIO;
 	}
 
 	return 0;
 }
 
+int hdcapm_mem_write32(struct hdcapm_dev *dev, u32 addr, u32 val)
+{
+	return hdcapm_mem_fill32(dev, addr, 1, val);
+}
+
 /* Read a single DWORD from the USB device memory. */
 int hdcapm_mem_read32(struct hdcapm_dev *dev, u32 addr, u32 *val)
 {
-	int len;
+	u32 len;
 	u8 rx[4];
 
 	/* Read bytes between to addresses
@@ -138,14 +529,12 @@ int hdcapm_mem_read32(struct hdcapm_dev *dev, u32 addr, u32 *val)
 		addr >> 24,
 	};
 
-	if (hdcapm_core_ep_send(dev, PIPE_EP4, &tx[0], sizeof(tx), 500) < 0) {
-		return -1;
-	}
-
 	/* Read 4 bytes from EP 3. */
-	/* TODO: shouldn;t the buffer length be 4? */
-	if (hdcapm_core_ep_recv(dev, PIPE_EP3, &rx[0], sizeof(rx), &len, 500) < 0) {
-		return -1;
+	if (hdcapm_core_ep_command(dev, &tx[0], sizeof(tx), &rx[0], sizeof(rx), &len, 1000) < 0) {
+		return -EIO;
+	}
+	if (len != sizeof(rx)) {
+		return -EPROTO;
 	}
 
 	*val = rx[0] | (rx[1] << 8) | (rx[2] << 16) | (rx[3] << 24);
@@ -155,10 +544,12 @@ int hdcapm_mem_read32(struct hdcapm_dev *dev, u32 addr, u32 *val)
 }
 
 
-/* Write a series of DMA DWORDS from the USB device memory. */
+/* Write a series of DMA DWORDS from the USB device memory.
+ * kmalloc'd arrays go out zero copy, anything else bounces through the transfer pool.
+ */
 int hdcapm_dmawrite32(struct hdcapm_dev *dev, u32 addr, const u32 *arr, u32 entries)
 {
-	int len;
+	int len, ret;
 	u8 rx;
 
 	/* EP4 Host -> 09 01 08 00 00 00 00 00 4E 63 05 00 00 20 00 00 */
@@ -183,79 +574,510 @@ int hdcapm_dmawrite32(struct hdcapm_dev *dev, u32 addr, const u32 *arr, u32 entr
 
 	dprintk(2, "%s(0x%08x, 0x%08x)\n", __func__, addr, entries);
 
-	if (hdcapm_core_ep_send(dev, PIPE_EP4, &tx[0], sizeof(tx), 500) < 0) {
-		return -1;
-	}
+	/* The ack and the payload must follow the command on the wire. */
+	hdcapm_core_usb_lock(dev);
 
 	/* Read 1 byte1 from EP 3. */
-	if (hdcapm_core_ep_recv(dev, PIPE_EP3, &rx, sizeof(rx), &len, 500) < 0) {
-		return -1;
+	if (__hdcapm_core_ep_command(dev, &tx[0], sizeof(tx), &rx, sizeof(rx), &len, 1000) < 0) {
+		ret = -EIO;
+		goto fail;
 	}
 
 	if (rx != 0) {
-		return -1;
+		/* The firmware refused the transfer. */
+		ret = -EPROTO;
+		goto fail;
 	}
 
 	/* Flush the buffer to device */
 	if (hdcapm_core_ep_send(dev, PIPE_EP2, (u8 *)arr, entries * sizeof(u32), 5000) < 0) {
-		return -1;
+		ret = -EIO;
+		goto fail;
+	}
+
+	hdcapm_core_usb_unlock(dev);
+	return 0;
+
+fail:
+	hdcapm_core_usb_unlock(dev);
+	return ret;
+}
+
+/* The dmawrite in flight in hdcapm_dmawrite32_stream(). The command and
+ * ack share a context, the EP2 payload has its own so it can be cancelled
+ * when the firmware refuses the transfer.
+ */
+struct hdcapm_dmawrite_slot {
+	struct hdcapm_urb_ctx cmd;
+	struct hdcapm_urb_ctx payload;
+	u8 tx[16];
+	u8 rx;
+	u32 acklen;
+	u8 *buf;
+};
+
+static void hdcapm_dmawrite_slot_post(struct hdcapm_dev *dev, struct hdcapm_dmawrite_slot *s,
+	u32 addr, const u32 *arr, u32 entries)
+{
+	s->tx[0] = 0x09;
+	s->tx[1] = 0x01; /* Write */
+	s->tx[2] = 0x08;
+	s->tx[3] = 0x00;
+	put_unaligned_le32(0, &s->tx[4]);
+	put_unaligned_le32(addr, &s->tx[8]);
+	put_unaligned_le32(entries, &s->tx[12]);
+	s->rx = 0xff;
+	s->acklen = 0;
+	memcpy(s->buf, arr, entries * sizeof(u32));
+
+	hdcapm_urb_ctx_init(dev, &s->cmd);
+	hdcapm_urb_ctx_init(dev, &s->payload);
+	hdcapm_urb_recv_copy(&s->cmd, PIPE_EP3, &s->rx, sizeof(s->rx), &s->acklen);
+	hdcapm_urb_send_copy(&s->cmd, PIPE_EP4, s->tx, sizeof(s->tx));
+	hdcapm_urb_send(&s->payload, PIPE_EP2, s->buf, entries * sizeof(u32));
+}
+
+/* Reap the slot, 0 when the firmware acked and took the payload. */
+static int hdcapm_dmawrite_slot_reap(struct hdcapm_dmawrite_slot *s)
+{
+	int ret;
+
+	ret = hdcapm_urb_wait(&s->cmd, 1000);
+	if (ret < 0 || s->rx != 0) {
+		dprintk(1, "%s() ack failed, ret = %d rx = 0x%02x\n", __func__, ret, s->rx);
+		hdcapm_urb_cancel(&s->payload);
+		hdcapm_urb_wait(&s->payload, 0);
+		return ret < 0 ? -EIO : -EPROTO;
+	}
+
+	if (hdcapm_urb_wait(&s->payload, 5000) < 0)
+		return -EIO;
+
+	return 0;
+}
+
+/* Write a large image as a stream of dmawrites, chunk dwords each. Every
+ * phase of a chunk is posted together, so the host controller doesn't idle
+ * waiting on us between phases, and each chunk is acked and checked before
+ * the next goes out. The wire is held for the whole image.
+ */
+int hdcapm_dmawrite32_stream(struct hdcapm_dev *dev, u32 addr, const u32 *arr, u32 entries, u32 chunk)
+{
+	struct hdcapm_dmawrite_slot *slot;
+	u32 off, cnt;
+	int ret = 0;
+
+	if (chunk == 0)
+		return -EINVAL;
+
+	slot = kzalloc(sizeof(*slot), GFP_KERNEL);
+	if (!slot)
+		return -ENOMEM;
+
+	slot->buf = kmalloc(chunk * sizeof(u32), GFP_KERNEL);
+	if (!slot->buf) {
+		kfree(slot);
+		return -ENOMEM;
+	}
+
+	dprintk(2, "%s(0x%08x, 0x%08x) %d chunks\n", __func__, addr, entries, DIV_ROUND_UP(entries, chunk));
+
+	hdcapm_core_usb_lock(dev);
+
+	for (off = 0; off < entries; off += cnt) {
+		cnt = min(chunk, entries - off);
+		hdcapm_dmawrite_slot_post(dev, slot, addr + off, arr + off, cnt);
+
+		ret = hdcapm_dmawrite_slot_reap(slot);
+		if (ret < 0) {
+			pr_err(KBUILD_MODNAME ": dmawrite of chunk %d at 0x%08x failed, ret = %d\n",
+				off / chunk, addr + off, ret);
+			break;
+		}
+	}
+
+	hdcapm_core_usb_unlock(dev);
+
+	kfree(slot->buf);
+	kfree(slot);
+
+	return ret;
+}
+
+/* Post the EP1 IN transfers for a dmaread payload, split into URBs of
+ * sizing.ep1_urb_bytes when calibration found that faster on this host.
+ * sg splits need page multiples, buffers have one sg entry per page.
+ */
+static void hdcapm_core_recv_payload(struct hdcapm_urb_ctx *ctx, u32 *arr, struct sg_table *sgt, u32 len, u32 *actual)
+{
+	struct hdcapm_dev *dev = ctx->dev;
+	u32 chunk = dev->sizing.ep1_urb_bytes;
+	struct scatterlist *sg;
+	u32 off, cpy, nents, i;
+
+	if (chunk == 0 || chunk >= len || (sgt && chunk % PAGE_SIZE)) {
+		if (sgt)
+			hdcapm_urb_recv_sg(ctx, PIPE_EP1, sgt->sgl, sgt->nents, len, actual);
+		else
+			hdcapm_urb_recv(ctx, PIPE_EP1, (u8 *)arr, len, actual);
+		return;
+	}
+
+	sg = sgt ? sgt->sgl : NULL;
+	for (off = 0; off < len; off += cpy) {
+		cpy = min(chunk, len - off);
+		if (!sgt) {
+			hdcapm_urb_recv(ctx, PIPE_EP1, (u8 *)arr + off, cpy, actual);
+			continue;
+		}
+
+		nents = DIV_ROUND_UP(cpy, PAGE_SIZE);
+		hdcapm_urb_recv_sg(ctx, PIPE_EP1, sg, nents, cpy, actual);
+		for (i = 0; i < nents && sg; i++)
+			sg = sg_next(sg);
+	}
+}
+
+/* Pipelined form of the dmaread command phase. The EP1 payload and EP3 ack
+ * IN URBs are posted before the EP4 command goes out, so the host controller
+ * collects each phase the moment the firmware produces it, instead of us
+ * round tripping through the scheduler between phases.
+ * The payload is posted on the caller's context and left in flight once the
+ * ack is good, it's cancelled when the ack is bad. Caller holds usb_lock.
+ */
+static int hdcapm_core_dmaread32_pipelined(struct hdcapm_urb_ctx *payload, const u8 *tx, u32 txlen, u32 *arr, struct sg_table *sgt, u32 entries, u32 *len)
+{
+	struct hdcapm_dev *dev = payload->dev;
+	struct hdcapm_urb_ctx cmd;
+	u32 acklen = 0;
+	u8 rx = 0xff;
+	int ret;
+
+	hdcapm_urb_ctx_init(dev, &cmd);
+
+	hdcapm_core_recv_payload(payload, arr, sgt, entries * sizeof(u32), len);
+	hdcapm_urb_recv_copy(&cmd, PIPE_EP3, &rx, sizeof(rx), &acklen);
+	hdcapm_urb_send_copy(&cmd, PIPE_EP4, tx, txlen);
+
+	ret = hdcapm_urb_wait(&cmd, 1000);
+	if (ret < 0 || rx != 0) {
+		dprintk(1, "%s() ack failed, ret = %d rx = 0x%02x\n", __func__, ret, rx);
+		hdcapm_urb_cancel(payload);
+		hdcapm_urb_wait(payload, 0);
+		return ret < 0 ? -EIO : -EPROTO;
+	}
+
+	return 0;
+}
+
+/* Post a receive into a scatter-gather list. When the host controller can't
+ * take the list in one URB, post one URB per fragment on the same context,
+ * so the timeout and cancel come from the URB engine like everything else.
+ * Buffer pages are lowmem, see hdcapm_buffer_alloc_pages().
+ */
+static void hdcapm_core_post_recv_sg(struct hdcapm_urb_ctx *ctx, int endpoint, struct sg_table *sgt, u32 len, u32 *actual)
+{
+	struct scatterlist *sg;
+	u32 off = 0, cnt;
+	int i;
+
+	if (hdcapm_urb_sg_capable(ctx->dev, sgt)) {
+		hdcapm_urb_recv_sg(ctx, endpoint, sgt->sgl, sgt->nents, len, actual);
+		return;
+	}
+
+	for_each_sg(sgt->sgl, sg, sgt->nents, i) {
+		if (off >= len)
+			break;
+		cnt = min(sg->length, len - off);
+		if (hdcapm_urb_recv(ctx, endpoint, sg_virt(sg), cnt, actual) < 0)
+			break;
+		off += cnt;
+	}
+}
+
+/* The command, ack and payload own the wire at TS drain priority. The
+ * firmware has only ever seen the three phases back to back, so the wire
+ * is held until the payload completes.
+ */
+static int __hdcapm_dmaread32(struct hdcapm_dev *dev, u32 addr, u32 *arr, struct sg_table *sgt, u32 entries)
+{
+	struct hdcapm_urb_ctx payload;
+	u32 len = 0;
+	int ret;
+	u8 rx;
+
+	/* EP4 Host -> 09 00 08 00 00 00 00 00 00 C8 05 00 00 04 00 00 */
+	u8 tx[] = {
+		0x09,
+		0x00, /* Read */
+		0x08,
+		0x00,
+		0x00,
+		0x00,
+		0x00,
+		0x00,
+		addr,
+		addr >>  8,
+		addr >> 16,
+		addr >> 24,
+		entries,
+		entries >>  8,
+		entries >> 16,
+		entries >> 24,
+	};
+
+	dprintk(2, "%s(0x%08x, 0x%08x)\n", __func__, addr, entries);
+
+	hdcapm_urb_ctx_init(dev, &payload);
+
+	/* The ack and the payload must follow the command on the wire. */
+	hdcapm_core_usb_lock_class(dev, HDCAPM_SCHED_DATA);
+
+	kl_histogram_sample_begin(&dev->stats->usb_codec_transfer_ack);
+
+	if (pipelined_dmaread && (sgt ? hdcapm_urb_sg_capable(dev, sgt) : hdcapm_core_dma_capable(arr))) {
+		ret = hdcapm_core_dmaread32_pipelined(&payload, &tx[0], sizeof(tx), arr, sgt, entries, &len);
+		if (ret < 0)
+			goto fail;
+		kl_histogram_sample_complete(&dev->stats->usb_codec_transfer_ack);
+
+		/* Measured from the ack, so it's directly comparable to the serial path. */
+		kl_histogram_sample_begin(&dev->stats->usb_codec_transfer_payload);
+	} else {
+		/* Read 1 byte1 from EP 3. */
+		if (__hdcapm_core_ep_command(dev, &tx[0], sizeof(tx), &rx, sizeof(rx), &len, 1000) < 0) {
+			ret = -EIO;
+			goto fail;
+		}
+
+		if (rx != 0) {
+			/* The firmware refused the transfer. */
+			ret = -EPROTO;
+			goto fail;
+		}
+		kl_histogram_sample_complete(&dev->stats->usb_codec_transfer_ack);
+
+		kl_histogram_sample_begin(&dev->stats->usb_codec_transfer_payload);
+		len = 0;
+		if (sgt) {
+			hdcapm_core_post_recv_sg(&payload, PIPE_EP1, sgt, entries * sizeof(u32), &len);
+		} else if (hdcapm_core_dma_capable(arr)) {
+			hdcapm_urb_recv(&payload, PIPE_EP1, (u8 *)arr, entries * sizeof(u32), &len);
+		} else {
+			/* Bounced through the transfer pool, this one completes under the lock. */
+			ret = hdcapm_core_ep_recv(dev, PIPE_EP1, (u8 *)arr, entries * sizeof(u32), &len, 5000);
+			if (ret < 0) {
+				ret = -EIO;
+				goto fail;
+			}
+		}
+	}
+
+	/* Flush the buffer from the device */
+	ret = hdcapm_urb_wait(&payload, 5000);
+	hdcapm_core_usb_unlock(dev);
+	if (ret < 0)
+		return -EIO;
+
+	/* Summed over every payload URB, a short one leaves stale data at the end. */
+	if (len != entries * sizeof(u32)) {
+		dprintk(1, "%s() short payload, %u of %u bytes\n", __func__, len, entries * (u32)sizeof(u32));
+		return -EPROTO;
+	}
+	kl_histogram_sample_complete(&dev->stats->usb_codec_transfer_payload);
+
+	return 0;
+
+fail:
+	hdcapm_core_usb_unlock(dev);
+	return ret;
+}
+
+/* Read a series of DMA DWORDS from the USB device memory.
+ * arr should come from kmalloc, the EP1 payload then lands directly in it
+ * without bouncing through the transfer pool.
+ */
+int hdcapm_dmaread32(struct hdcapm_dev *dev, u32 addr, u32 *arr, u32 entries)
+{
+	return __hdcapm_dmaread32(dev, addr, arr, NULL, entries);
+}
+
+/* Do dmareads post the EP1 payload ahead of the command (pipelined_dmaread)? */
+int hdcapm_core_pipelined_dmaread(struct hdcapm_dev *dev)
+{
+	return pipelined_dmaread;
+}
+
+/* Read a series of DMA DWORDS from the USB device memory into a hdcapm_buffer,
+ * scatter-gather when the buffer is page backed (see hdcapm_buffer_alloc).
+ */
+int hdcapm_dmaread32_buffer(struct hdcapm_dev *dev, u32 addr, struct hdcapm_buffer *buf, u32 entries)
+{
+	int ret;
+
+	if (!buf->pages)
+		return __hdcapm_dmaread32(dev, addr, (u32 *)buf->ptr, NULL, entries);
+
+	/* usb_read() swaps the last payload in place through the vmap, write any
+	 * dirty alias lines back now so they can't land on top of the DMA.
+	 */
+	flush_kernel_vmap_range(buf->ptr, entries * sizeof(u32));
+
+	ret = __hdcapm_dmaread32(dev, addr, NULL, &buf->sgt, entries);
+
+	/* The device wrote through the page mappings, drop any stale vmap alias lines. */
+	invalidate_kernel_vmap_range(buf->ptr, entries * sizeof(u32));
+
+	return ret;
+}
+
+/* Write a DWORD to a USB device register. */
+int hdcapm_write32(struct hdcapm_dev *dev, u32 addr, u32 val)
+{
+	/* EP4 Host -> 01 01 01 00 04 05 00 00 55 00 00 00 */
+	u8 tx[] = {
+		0x01,
+		0x01, /* Write */
+		0x01,
+		0x00,
+		addr,
+		addr >>  8,
+		addr >> 16,
+		addr >> 24,
+		val,
+		val >>  8,
+		val >> 16,
+		val >> 24,
+	};
+
+	dprintk(2, "%s(0x%08x, 0x%08x)\n", __func__, addr, val);
+
+	if (hdcapm_core_ep_command(dev, &tx[0], sizeof(tx), NULL, 0, NULL, 500) < 0) {
+		hdcapm_shadow_update(dev, addr, 0, 0);
+		return -EIO;
 	}
 
+	/* Write through, the shadow now matches the hardware. */
+	hdcapm_shadow_update(dev, addr, val, 1);
+
+	return 0;
+}
+
+/* Preallocated status read path. Register reads are the hottest transaction
+ * we have, the pump polls the 0x6b0 block every few ms. The command and reply
+ * buffers and both URBs are allocated once in probe, the reply lands
+ * directly in status_rx and gets a single endian conversion.
+ */
+static int hdcapm_core_status_alloc(struct hdcapm_dev *dev)
+{
+	dev->status_tx = kzalloc(8, GFP_KERNEL);
+	dev->status_rx = kcalloc(HDCAPM_STATUS_MAX_WORDS, sizeof(__le32), GFP_KERNEL);
+	dev->status_txfer = hdcapm_urb_xfer_alloc();
+	dev->status_rxfer = hdcapm_urb_xfer_alloc();
+
+	if (!dev->status_tx || !dev->status_rx || !dev->status_txfer || !dev->status_rxfer)
+		return -ENOMEM;
+
+	return 0; /* Success */
+}
+
+static void hdcapm_core_status_free(struct hdcapm_dev *dev)
+{
+	hdcapm_urb_xfer_free(dev->status_rxfer);
+	hdcapm_urb_xfer_free(dev->status_txfer);
+	kfree(dev->status_rx);
+	kfree(dev->status_tx);
+}
+
+static int hdcapm_core_status_read(struct hdcapm_dev *dev, u32 addr, u32 wordcount, u32 *arr, int le_to_cpu)
+{
+	struct hdcapm_urb_ctx ctx;
+	u32 readlenbytes = wordcount * sizeof(u32);
+	u32 len = 0;
+	u8 *tx = dev->status_tx;
+	int ret, i;
+
+	if (wordcount == 0 || wordcount > HDCAPM_STATUS_MAX_WORDS)
+		return -EINVAL;
+
+	hdcapm_core_usb_lock(dev);
+
+	/* EP4 Host -> 01 00 07 00 B0 06 00 00 */
+	tx[0] = 0x01;
+	tx[1] = 0x00; /* Read */
+	tx[2] = wordcount;
+	tx[3] = 0x00;
+	put_unaligned_le32(addr, &tx[4]);
+
+	/* Flush this to EP4 via a write, read N DWORDS from EP 3. */
+	hdcapm_urb_ctx_init(dev, &ctx);
+	hdcapm_urb_send_xfer(&ctx, dev->status_txfer, PIPE_EP4, tx, 8);
+	hdcapm_urb_recv_xfer(&ctx, dev->status_rxfer, PIPE_EP3, (u8 *)dev->status_rx, readlenbytes, &len);
+	ret = hdcapm_urb_wait(&ctx, 1000);
+	if (ret < 0)
+		ret = -EIO;
+	else
+	if (len != readlenbytes)
+		ret = -EPROTO;
+	else
+	if (le_to_cpu) {
+		for (i = 0; i < wordcount; i++)
+			arr[i] = le32_to_cpu(dev->status_rx[i]);
+	} else
+		memcpy(arr, dev->status_rx, readlenbytes);
+
+	hdcapm_core_usb_unlock(dev);
+
+	return ret;
+}
+
+/* Read a DWORD from a USB device register. */
+int hdcapm_read32(struct hdcapm_dev *dev, u32 addr, u32 *val)
+{
+	int ret;
+
+	ret = hdcapm_core_status_read(dev, addr, 1, val, 1);
+	if (ret < 0)
+		return ret;
+
+	dprintk(2, "%s(0x%08x, 0x%08x)\n", __func__, addr, *val);
+
+	hdcapm_shadow_update(dev, addr, *val, 1);
+
 	return 0;
 }
 
-/* Read a series of DMA DWORDS from the USB device memory. */
-int hdcapm_dmaread32(struct hdcapm_dev *dev, u32 addr, u32 *arr, u32 entries)
+/* Read (bulk) a number of DWORDS from device registers and endian convert if requested. */
+int hdcapm_read32_array(struct hdcapm_dev *dev, u32 addr, u32 wordcount, u32 *arr, int le_to_cpu)
 {
-	int len;
-	u8 rx;
-
-	/* EP4 Host -> 09 00 08 00 00 00 00 00 00 C8 05 00 00 04 00 00 */
-	u8 tx[] = {
-		0x09,
-		0x00, /* Read */
-		0x08,
-		0x00,
-		0x00,
-		0x00,
-		0x00,
-		0x00,
-		addr,
-		addr >>  8,
-		addr >> 16,
-		addr >> 24,
-		entries,
-		entries >>  8,
-		entries >> 16,
-		entries >> 24,
-	};
-
-	dprintk(2, "%s(0x%08x, 0x%08x)\n", __func__, addr, entries);
-
-	if (hdcapm_core_ep_send(dev, PIPE_EP4, &tx[0], sizeof(tx), 500) < 0) {
-		return -1;
-	}
+	int ret;
 
-	/* Read 1 byte1 from EP 3. */
-	if (hdcapm_core_ep_recv(dev, PIPE_EP3, &rx, sizeof(rx), &len, 500) < 0) {
-		return -1;
-	}
+	ret = hdcapm_core_status_read(dev, addr, wordcount, arr, le_to_cpu);
 
-	if (rx != 0) {
-		return -1;
-	}
+	dprintk(2, "%s(0x%08x) = %d\n", __func__, addr, ret);
 
-	/* Flush the buffer to device */
-	if (hdcapm_core_ep_recv(dev, PIPE_EP1, (u8 *)arr, entries * sizeof(u32), &len, 5000) < 0) {
-		return -1;
-	}
+	return ret;
+}
 
-	return 0;
+/* Start a register batch. Every write/read added is submitted immediately,
+ * so the USB transfers are pipelined while the caller builds the rest of
+ * the sequence. Nothing is waited on until hdcapm_batch_commit().
+ */
+void hdcapm_batch_begin(struct hdcapm_dev *dev, struct hdcapm_batch *b)
+{
+	/* Held until commit, the EP3 replies must match our reads. */
+	hdcapm_core_usb_lock(dev);
+	hdcapm_urb_ctx_init(dev, &b->ctx);
+	b->count = 0;
+	b->nr_reads = 0;
 }
 
-/* Write a DWORD to a USB device register. */
-int hdcapm_write32(struct hdcapm_dev *dev, u32 addr, u32 val)
+/* Queue a DWORD write to a USB device register. */
+int hdcapm_batch_write32(struct hdcapm_batch *b, u32 addr, u32 val)
 {
+	int ret;
+
 	/* EP4 Host -> 01 01 01 00 04 05 00 00 55 00 00 00 */
 	u8 tx[] = {
 		0x01,
@@ -274,18 +1096,25 @@ int hdcapm_write32(struct hdcapm_dev *dev, u32 addr, u32 val)
 
 	dprintk(2, "%s(0x%08x, 0x%08x)\n", __func__, addr, val);
 
-	if (hdcapm_core_ep_send(dev, PIPE_EP4, &tx[0], sizeof(tx), 500) < 0) {
-		return -1;
-	}
+	b->count++;
+	ret = hdcapm_urb_send_copy(&b->ctx, PIPE_EP4, &tx[0], sizeof(tx));
 
-	return 0;
+	/* Write through like hdcapm_write32(). We hold usb_lock until commit,
+	 * nobody does a read-modify-write against the shadow meanwhile and a
+	 * failed commit invalidates it.
+	 */
+	hdcapm_shadow_update(b->ctx.dev, addr, val, ret == 0);
+
+	return ret;
 }
 
-/* Read a DWORD from a USB device register. */
-int hdcapm_read32(struct hdcapm_dev *dev, u32 addr, u32 *val)
+/* Queue a DWORD read from a USB device register. The EP3 replies arrive in
+ * command order, *val is written during hdcapm_batch_commit(), which fails
+ * with -EIO if any reply comes back short.
+ */
+int hdcapm_batch_read32(struct hdcapm_batch *b, u32 addr, u32 *val)
 {
-	int len;
-	u8 rx[4];
+	u32 n;
 
 	/* EP4 Host -> 01 00 01 00 00 05 00 00 */
 	u8 tx[] = {
@@ -299,111 +1128,294 @@ int hdcapm_read32(struct hdcapm_dev *dev, u32 addr, u32 *val)
 		addr >> 24,
 	};
 
-	/* Flush this to EP4 via a write. */
-	if (hdcapm_core_ep_send(dev, PIPE_EP4, &tx[0], sizeof(tx), 500) < 0) {
-		return -1;
+	if (b->nr_reads >= HDCAPM_BATCH_MAX_READS) {
+		printk(KERN_ERR "%s() too many reads in one batch\n", __func__);
+		hdcapm_urb_ctx_error(&b->ctx, -E2BIG);
+		return -E2BIG;
 	}
 
-	/* Read 4 bytes from EP 3. */
-	if (hdcapm_core_ep_recv(dev, PIPE_EP3, &rx[0], sizeof(rx), &len, 500) < 0) {
-		return -1;
-	}
+	n = b->nr_reads++;
+	*val = 0;
+	b->reads[n] = val;
+	b->actual[n] = 0;
+	b->count++;
 
-//	dprintk(1, "%02x %02x %02x %02x\n", rx[0], rx[1], rx[2], rx[3]);
-	*val = rx[0] | (rx[1] << 8) | (rx[2] << 16) | (rx[3] << 24);
+	hdcapm_urb_send_copy(&b->ctx, PIPE_EP4, &tx[0], sizeof(tx));
+	return hdcapm_urb_recv_copy(&b->ctx, PIPE_EP3, (u8 *)val, sizeof(*val), &b->actual[n]);
+}
 
-	dprintk(2, "%s(0x%08x, 0x%08x)\n", __func__, addr, *val);
+/* Wait for the whole batch, return the first error seen (if any). */
+int hdcapm_batch_commit(struct hdcapm_batch *b)
+{
+	int ret, i;
+
+	ret = hdcapm_urb_wait(&b->ctx, 500 + (b->count * 10));
+	hdcapm_core_usb_unlock(b->ctx.dev);
+	if (ret < 0) {
+		printk(KERN_ERR "%s() batch of %d transactions failed, ret = %d\n", __func__, b->count, ret);
+		/* We can't tell which of the writes landed. */
+		hdcapm_shadow_invalidate(b->ctx.dev);
+		return ret;
+	}
+
+	/* Replies are raw LE dwords from the firmware. */
+	for (i = 0; i < b->nr_reads; i++) {
+		if (b->actual[i] != sizeof(u32)) {
+			printk(KERN_ERR "%s() read %d of the batch returned %u bytes\n", __func__, i, b->actual[i]);
+			return -EIO;
+		}
+		*b->reads[i] = le32_to_cpu(*b->reads[i]);
+	}
 
 	return 0;
 }
 
-/* Read (bulk) a number of DWORDS from device registers and endian convert if requested. */
-int hdcapm_read32_array(struct hdcapm_dev *dev, u32 addr, u32 wordcount, u32 *arr, int le_to_cpu)
+/* Set one or more bits high int a USB device register. */
+void hdcapm_set32(struct hdcapm_dev *dev, u32 addr, u32 mask)
 {
-	int len, i, j;
-	int readlenbytes = wordcount * sizeof(u32);
-	u8 *rx;
+	u32 val;
 
-	/* EP4 Host -> 01 00 07 00 B0 06 00 00 */
-	u8 tx[] = {
-		0x01,
-		0x00, /* Read */
-		wordcount,
-		0x00,
-		addr,
-		addr >>  8,
-		addr >> 16,
-		addr >> 24,
-	};
+	hdcapm_core_usb_lock(dev);
+	if (hdcapm_shadow_read32(dev, addr, &val) == 0) {
+		val |= mask;
+		hdcapm_write32(dev, addr, val);
+	}
+	hdcapm_core_usb_unlock(dev);
+}
 
-	rx = kzalloc(readlenbytes, GFP_KERNEL);
-	if (!rx)
-		return -ENOMEM;
+/* Set one or more bits low int a USB device register. */
+void hdcapm_clr32(struct hdcapm_dev *dev, u32 addr, u32 mask)
+{
+	u32 val;
 
-	/* Flush this to EP4 via a write. */
-	if (hdcapm_core_ep_send(dev, PIPE_EP4, &tx[0], sizeof(tx), 500) < 0) {
-		kfree(rx);
-		return -1;
+	hdcapm_core_usb_lock(dev);
+	if (hdcapm_shadow_read32(dev, addr, &val) == 0) {
+		val &= ~mask;
+		hdcapm_write32(dev, addr, val);
 	}
+	hdcapm_core_usb_unlock(dev);
+}
 
-	/* Read 4 bytes from EP 3. */
-	if (hdcapm_core_ep_recv(dev, PIPE_EP3, rx, readlenbytes, &len, 500) < 0) {
-		kfree(rx);
-		return -1;
+/* Recovery step 1, clear any halt/stall condition on our bulk endpoints. */
+int hdcapm_core_clear_halts(struct hdcapm_dev *dev)
+{
+	return dev->ops->clear_halts(dev);
+}
+
+/* Recovery step 3, reset the USB port. The firmware is gone afterwards, the
+ * caller has to reload it.
+ */
+int hdcapm_core_port_reset(struct hdcapm_dev *dev)
+{
+	int ret;
+
+	dev->fw_loaded = 0;
+	dev->armed = 0;
+	ret = dev->ops->port_reset(dev);
+	if (ret < 0)
+		pr_err(KBUILD_MODNAME ": %s port reset failed, ret = %d\n", dev->ops->name, ret);
+
+	return ret;
+}
+
+/* Take a runtime PM reference, resuming the device when it was suspended.
+ * Transports without runtime PM always succeed.
+ */
+int hdcapm_core_pm_get(struct hdcapm_dev *dev)
+{
+	ktime_t start;
+	int ret;
+
+	if (!dev->ops->pm_get)
+		return 0;
+
+	start = ktime_get();
+	ret = dev->ops->pm_get(dev);
+	if (ret < 0) {
+		pr_err(KBUILD_MODNAME ": %s resume failed, ret = %d\n", dev->ops->name, ret);
+		return ret;
+	}
+
+	if (dev->pm_resumed) {
+		dev->pm_resumed = 0;
+		kl_histogram_update_with_value(&dev->totals.pm_resume, ktime_ms_delta(ktime_get(), start));
 	}
 
-	dprintk(2, "%s(0x%08x) =\n", __func__, addr);
-	for (i = 0, j = 0; i < len; i += 4, j++) {
+	return 0;
+}
 
-		*(arr + j) = rx[i + 0] | (rx[i + 1] << 8) | (rx[i + 2] << 16) | (rx[i + 3] << 24);
+void hdcapm_core_pm_put(struct hdcapm_dev *dev)
+{
+	if (dev->ops->pm_put)
+		dev->ops->pm_put(dev);
+}
 
-		if (le_to_cpu)
-			*(arr + j) = le32_to_cpu(*(arr + j));
+/* Ask the thread to stop the capture, doesn't wait for it, see
+ * hdcapm_core_wait_stopped(). With linger set a running encoder is left
+ * going, hdcapm_core_linger() stops it if nobody comes back in time.
+ */
+int hdcapm_core_stop_streaming(struct hdcapm_dev *dev)
+{
+	mutex_lock(&dev->state_lock);
+	dev->start_pending = 0;
+	if (dev->state == STATE_START || dev->state == STATE_STARTED) {
+		if (linger) {
+			dev->lingering = 1;
+			dev->linger_expires = jiffies + msecs_to_jiffies(linger * 1000);
+		} else {
+			reinit_completion(&dev->stop_done);
+			dev->state = STATE_STOP;
+		}
 	}
+	mutex_unlock(&dev->state_lock);
+	wake_up(&dev->thread_wait);
+
+	return 0; /* Success */
+}
+
+/* Wait, up to 5 seconds, for a stop still in progress to finish. */
+int hdcapm_core_wait_stopped(struct hdcapm_dev *dev)
+{
+	long ret;
+
+	ret = wait_for_completion_interruptible_timeout(&dev->stop_done, msecs_to_jiffies(5000));
+	if (ret < 0)
+		return ret;
+	if (ret == 0)
+		pr_err(KBUILD_MODNAME ": timeout waiting for the capture to stop\n");
 
-	kfree(rx);
 	return 0;
 }
 
-/* Set one or more bits high int a USB device register. */
-void hdcapm_set32(struct hdcapm_dev *dev, u32 addr, u32 mask)
+/* The thread has the encoder running, unless a stop overtook the start. */
+int hdcapm_core_streaming_started(struct hdcapm_dev *dev)
 {
-	u32 val;
-	hdcapm_read32(dev, addr, &val);
-	val |= mask;
-	hdcapm_write32(dev, addr, val);
+	int ret = 0;
+
+	mutex_lock(&dev->state_lock);
+	if (dev->state == STATE_START) {
+		dev->state = STATE_STARTED;
+		ret = 1;
+	}
+	mutex_unlock(&dev->state_lock);
+
+	return ret;
 }
 
-/* Set one or more bits low int a USB device register. */
-void hdcapm_clr32(struct hdcapm_dev *dev, u32 addr, u32 mask)
+/* The thread finished a stop, pick up any start queued behind it. */
+void hdcapm_core_streaming_stopped(struct hdcapm_dev *dev)
 {
-	u32 val;
-	hdcapm_read32(dev, addr, &val);
-	val &= ~mask;
-	hdcapm_write32(dev, addr, val);
+	mutex_lock(&dev->state_lock);
+	dev->lingering = 0;
+	if (dev->start_pending) {
+		dev->start_pending = 0;
+		dev->state = STATE_START;
+	} else
+		dev->state = STATE_STOPPED;
+	complete_all(&dev->stop_done);
+	mutex_unlock(&dev->state_lock);
 }
 
-int hdcapm_core_stop_streaming(struct hdcapm_dev *dev)
+/* The thread gave up on a capture. Move to STOP under the lock, so a
+ * start racing with it is queued rather than lost, see
+ * hdcapm_core_streaming_stopped().
+ */
+void hdcapm_core_streaming_abort(struct hdcapm_dev *dev)
 {
+	mutex_lock(&dev->state_lock);
+	dev->lingering = 0;
+	reinit_completion(&dev->stop_done);
 	dev->state = STATE_STOP;
+	mutex_unlock(&dev->state_lock);
+}
 
-	return 0; /* Success */
+/* Called from the capture loop. Nobody is reading a lingering encoder,
+ * drop what it produces, and stop it once linger runs out or the device
+ * goes away.
+ */
+void hdcapm_core_linger(struct hdcapm_dev *dev)
+{
+	mutex_lock(&dev->state_lock);
+	if (dev->lingering) {
+		hdcapm_buffers_move_all(dev, &dev->list_buf_free, &dev->list_buf_used);
+		if (time_after(jiffies, dev->linger_expires) || kthread_should_stop()) {
+			dprintk(1, "%s() linger expired, stopping\n", __func__);
+			dev->lingering = 0;
+			reinit_completion(&dev->stop_done);
+			dev->state = STATE_STOP;
+		}
+	}
+	mutex_unlock(&dev->state_lock);
 }
 
+/* Stamp a phase of the current session's start up, first time only. */
+void hdcapm_core_session_mark(struct hdcapm_dev *dev, int phase)
+{
+	struct hdcapm_session *s = &dev->sessions[dev->session_seq & (HDCAPM_SESSIONS - 1)];
+
+	if (s->seq != dev->session_seq || s->start_ns == 0 || s->phase_us[phase])
+		return;
+
+	s->phase_us[phase] = max_t(u32, div_u64(ktime_get_ns() - s->start_ns, 1000), 1);
+}
+
+/* Ask the thread to start a capture. A lingering encoder is simply
+ * handed back to the reader, a start during a stop waits for the thread
+ * to finish the stop first.
+ */
 int hdcapm_core_start_streaming(struct hdcapm_dev *dev)
 {
-	dev->state = STATE_START;
+	struct hdcapm_session *s;
+
+	mutex_lock(&dev->state_lock);
+
+	/* New session, reuse the oldest slot. */
+	s = &dev->sessions[++dev->session_seq & (HDCAPM_SESSIONS - 1)];
+	memset(s, 0, sizeof(*s));
+	s->seq = dev->session_seq;
+	s->start_ns = ktime_get_ns();
+
+	switch (dev->state) {
+	case STATE_START:
+	case STATE_STARTED:
+		if (dev->lingering) {
+			/* Whatever it produced while nobody was reading is stale. */
+			hdcapm_buffers_move_all(dev, &dev->list_buf_free, &dev->list_buf_used);
+			dev->lingering = 0;
+			s->lingered = 1;
+			dev->totals.linger_resumes++;
+		}
+		break;
+	case STATE_STOP:
+		dev->start_pending = 1;
+		dev->totals.start_queued++;
+		break;
+	default:
+		dev->state = STATE_START;
+	}
+
+	mutex_unlock(&dev->state_lock);
+	wake_up(&dev->thread_wait);
 
 	return 0; /* Success */
 }
 
+/* Nobody has the device open and nothing is capturing. */
+static int hdcapm_thread_idle(struct hdcapm_dev *dev)
+{
+	return atomic_read(&dev->users) == 0 && dev->state == STATE_STOPPED && !dev->armed;
+}
+
 /* Worker thread to poll the HDMI receiver, and run the USB
  * transfer mechanism when the encoder starts.
+ * While idle it sleeps until an open or a stream start, rather than
+ * polling the receiver and keeping the device out of autosuspend.
  */
 static int hdcapm_thread_function(void *data)
 {
 	struct hdcapm_dev *dev = data;
 	struct v4l2_dv_timings timings;
+	int locked;
 	int ret;
 
 	dev->thread_active = 1;
@@ -412,22 +1424,52 @@ static int hdcapm_thread_function(void *data)
 	set_freezable();
 
 	while (1) {
-		msleep_interruptible(thread_poll_interval);
+		if (hdcapm_thread_idle(dev))
+			wait_event_freezable(dev->thread_wait,
+				kthread_should_stop() || !hdcapm_thread_idle(dev));
+		else
+			wait_event_freezable_timeout(dev->thread_wait,
+				kthread_should_stop() || dev->state == STATE_START ||
+				dev->state == STATE_STOP,
+				msecs_to_jiffies(thread_poll_interval));
 
 		if (kthread_should_stop())
 			break;
 
-		try_to_freeze();
+		/* A stop that overtook its start before we picked it up. */
+		if (dev->state == STATE_STOP)
+			hdcapm_core_streaming_stopped(dev);
 
-		if (dev->state == STATE_STOPPED) {
+		/* An opener holds a PM reference, the device is awake. */
+		locked = 0;
+		if (dev->state == STATE_STOPPED && atomic_read(&dev->users)) {
 			ret = v4l2_subdev_call(dev->sd, video, query_dv_timings, &timings);
 			if (ret == 0) {
+				locked = 1;
+			}
+		}
+
+		/* Pre-arm the encoder, or tear it down after the last close. */
+		if (dev->state == STATE_STOPPED && (dev->armed || atomic_read(&dev->users))) {
+			if (hdcapm_core_pm_get(dev) == 0) {
+				hdcapm_compressor_idle(dev, locked);
+				hdcapm_core_pm_put(dev);
 			}
 		}
 
 		if (dev->state == STATE_START) {
+			hdcapm_core_session_mark(dev, HDCAPM_PHASE_START_SEEN);
+
+			/* Hold the device awake until the stop has finished on the wire. */
+			if (hdcapm_core_pm_get(dev) < 0) {
+				hdcapm_core_streaming_stopped(dev);
+				continue;
+			}
+
 			/* This is a blocking func. */
 			hdcapm_compressor_run(dev);
+
+			hdcapm_core_pm_put(dev);
 		}
 	}
 
@@ -502,34 +1544,16 @@ static void hdcapm_notify(struct v4l2_subdev *sd, unsigned int notification, voi
 	}
 }
 
-static int hdcapm_usb_probe(struct usb_interface *interface, const struct usb_device_id *id)
+/* Everything but the bus specific checks, shared by the USB and mock transports. */
+int hdcapm_core_probe(struct device *parent, const struct hdcapm_transport_ops *ops, void *priv,
+	struct usb_device *udev, struct usb_interface *intf, struct hdcapm_dev **out)
 {
 	struct hdcapm_dev *dev;
 	struct hdcapm_buffer *buf;
-	struct usb_device *udev;
 	struct i2c_board_info mst3367_info;
 	struct mst3367_platform_data mst3367_pdata;
 	int ret, i;
 
-	udev = interface_to_usbdev(interface);
-
-	if (interface->altsetting->desc.bInterfaceNumber != 0) {
-		ret = -ENODEV;
-		goto fail0;
-	}
-
-	dprintk(1, "%s() vendor id 0x%x device id 0x%x\n", __func__,
-		le16_to_cpu(udev->descriptor.idVendor),
-		le16_to_cpu(udev->descriptor.idProduct));
-
-	/* Ensure the bus speed is 480Mbps. */
-	if (udev->speed != USB_SPEED_HIGH) {
-		pr_err(KBUILD_MODNAME ": Device initialization failed.\n");
-		pr_err(KBUILD_MODNAME ": Device must be connected to a USB 2.0 port (480Mbps).\n");
-		ret = -ENODEV;
-		goto fail0;
-	}
-
 	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
 	if (dev == NULL) {
 		pr_err(KBUILD_MODNAME ": failed to allocate memory\n");
@@ -537,9 +1561,8 @@ static int hdcapm_usb_probe(struct usb_interface *interface, const struct usb_de
 		goto fail1;
 	}
 
-	dev->xferbuf = kzalloc(XFERBUF_SIZE, GFP_KERNEL);
-	if (dev->xferbuf == NULL) {
-		pr_err(KBUILD_MODNAME ": failed to allocate memory for usb transfer buffer\n");
+	if (hdcapm_core_xferpool_alloc(dev) < 0 || hdcapm_core_status_alloc(dev) < 0) {
+		pr_err(KBUILD_MODNAME ": failed to allocate memory for usb transfer buffers\n");
 		ret = -ENOMEM;
 		goto fail2;
 	}
@@ -551,17 +1574,41 @@ static int hdcapm_usb_probe(struct usb_interface *interface, const struct usb_de
 		goto fail2;
 	}
 	hdcapm_core_statistics_reset(dev);
+	hdcapm_core_totals_init(dev);
 
 	strlcpy(dev->name, "Startech HDCAPM Encoder", sizeof(dev->name));
+	mutex_lock(&devlist);
+	dev->nr = devlist_count++;
+	mutex_unlock(&devlist);
 	dev->state = STATE_STOPPED;
+	dev->ops = ops;
+	dev->transport_priv = priv;
+	dev->sizing.ep1_urb_bytes = 0;
+	dev->sizing.ep2_chunk_dwords = 0x2000;
+	dev->parent = parent;
 	dev->udev = udev;
+	dev->intf = intf;
 
 	mutex_init(&dev->lock);
 	mutex_init(&dev->dmaqueue_lock);
+	spin_lock_init(&dev->sched.lock);
+	init_waitqueue_head(&dev->sched.wait);
+	spin_lock_init(&dev->shadow_lock);
+	spin_lock_init(&dev->ep_stats_lock);
 	INIT_LIST_HEAD(&dev->list_buf_free);
 	INIT_LIST_HEAD(&dev->list_buf_used);
 	init_waitqueue_head(&dev->wait_read);
-	usb_set_intfdata(interface, dev);
+	init_waitqueue_head(&dev->thread_wait);
+	atomic_set(&dev->users, 0);
+	mutex_init(&dev->state_lock);
+	init_completion(&dev->stop_done);
+	complete_all(&dev->stop_done); /* Nothing to stop yet. */
+
+	/* The driver is the only owner of the GPIO block, the bitbanged
+	 * I2C bus and the compressor GPIO setup are read-modify-write heavy.
+	 */
+	hdcapm_shadow_enable(dev, REG_GPIO_OE);
+	hdcapm_shadow_enable(dev, REG_GPIO_DATA_WR);
 
 	/* Register the I2C buses. */
 	if (hdcapm_i2c_register(dev, &dev->i2cbus[0], 0) < 0) {
@@ -590,8 +1637,12 @@ static int hdcapm_usb_probe(struct usb_interface *interface, const struct usb_de
 	hdcapm_compressor_init_gpios(dev);
 #endif
 
-	/* Attach HDMI receiver */
-	ret = v4l2_device_register(&interface->dev, &dev->v4l2_dev);
+	/* Attach HDMI receiver. A parent without a bound driver (the mock
+	 * platform device) can't name the v4l2_device for us.
+	 */
+	if (!parent->driver)
+		snprintf(dev->v4l2_dev.name, sizeof(dev->v4l2_dev.name), "%s %s", KBUILD_MODNAME, dev_name(parent));
+	ret = v4l2_device_register(parent, &dev->v4l2_dev);
 	if (ret < 0) {
 		pr_err(KBUILD_MODNAME ": v4l2_device_register failed\n");
 		ret = -EINVAL;
@@ -652,10 +1703,11 @@ static int hdcapm_usb_probe(struct usb_interface *interface, const struct usb_de
 	/* Finish the rest of the hardware configuration. */
 	mutex_lock(&devlist);
 	list_add_tail(&dev->devlist, &hdcapm_devlist);
-	devlist_count++;
 	mutex_unlock(&devlist);
 
-	pr_info(KBUILD_MODNAME ": Registered device '%s'\n", dev->name);
+	hdcapm_debugfs_register(dev);
+
+	pr_info(KBUILD_MODNAME ": Registered device '%s' (%s transport)\n", dev->name, ops->name);
 
 #if TIMER_EVAL
 	setup_timer(&dev->ktimer, _ktimer_event, (unsigned long)dev);
@@ -668,6 +1720,7 @@ static int hdcapm_usb_probe(struct usb_interface *interface, const struct usb_de
 #endif
 #endif /* TIMER_EVAL */
 
+	*out = dev;
 	return 0; /* Success */
 
 fail9:
@@ -689,20 +1742,58 @@ fail3:
 fail2_1:
 	kfree(dev->stats);
 fail2:
-	kfree(dev->xferbuf);
+	hdcapm_core_status_free(dev);
+	hdcapm_core_xferpool_free(dev);
 fail1:
 	kfree(dev);
-fail0:
 	return ret;
 }
 
-static void hdcapm_usb_disconnect(struct usb_interface *interface)
+static int hdcapm_usb_probe(struct usb_interface *interface, const struct usb_device_id *id)
+{
+	struct hdcapm_dev *dev;
+	struct usb_device *udev;
+	int ret;
+
+	udev = interface_to_usbdev(interface);
+
+	if (interface->altsetting->desc.bInterfaceNumber != 0)
+		return -ENODEV;
+
+	dprintk(1, "%s() vendor id 0x%x device id 0x%x\n", __func__,
+		le16_to_cpu(udev->descriptor.idVendor),
+		le16_to_cpu(udev->descriptor.idProduct));
+
+	/* Ensure the bus speed is 480Mbps. */
+	if (udev->speed != USB_SPEED_HIGH) {
+		pr_err(KBUILD_MODNAME ": Device initialization failed.\n");
+		pr_err(KBUILD_MODNAME ": Device must be connected to a USB 2.0 port (480Mbps).\n");
+		return -ENODEV;
+	}
+
+	ret = hdcapm_core_probe(&interface->dev, &hdcapm_usb_transport, NULL, udev, interface, &dev);
+	if (ret < 0)
+		return ret;
+
+	usb_set_intfdata(interface, dev);
+
+	/* Idle until someone opens the device, see hdcapm_thread_function(). */
+	if (autosuspend_delay >= 0) {
+		pm_runtime_set_autosuspend_delay(&udev->dev, autosuspend_delay);
+		usb_enable_autosuspend(udev);
+	}
+
+	return 0; /* Success */
+}
+
+void hdcapm_core_remove(struct hdcapm_dev *dev)
 {
-	struct hdcapm_dev *dev = usb_get_intfdata(interface);
 	int i;
 
 	dprintk(1, "%s()\n", __func__);
 
+	hdcapm_debugfs_unregister(dev);
+
 #if TIMER_EVAL
 	del_timer_sync(&dev->ktimer);
 	hrtimer_cancel(&dev->hrtimer);
@@ -735,7 +1826,8 @@ static void hdcapm_usb_disconnect(struct usb_interface *interface)
 	hdcapm_buffers_move_all(dev, &dev->list_buf_free, &dev->list_buf_used);
 	hdcapm_buffers_free_all(dev, &dev->list_buf_free);
 
-	kfree(dev->xferbuf);
+	hdcapm_core_status_free(dev);
+	hdcapm_core_xferpool_free(dev);
 	kfree(dev->stats);
 
 	mutex_lock(&devlist);
@@ -743,15 +1835,28 @@ static void hdcapm_usb_disconnect(struct usb_interface *interface)
 	mutex_unlock(&devlist);
 }
 
+static void hdcapm_usb_disconnect(struct usb_interface *interface)
+{
+	hdcapm_core_remove(usb_get_intfdata(interface));
+}
+
 static int hdcapm_suspend(struct usb_interface *interface, pm_message_t message)
 {
 	struct hdcapm_dev *dev = usb_get_intfdata(interface);
 	if (!dev)
 		return 0;
 
-	/* TODO: Power off the HDMI receiver? */
+	/* The capture thread holds a reference, this only catches the
+	 * window where it is still winding the firmware down.
+	 */
+	if (PMSG_IS_AUTO(message) && dev->state != STATE_STOPPED)
+		return -EBUSY;
+
+	/* Drop the HDMI link, the source stops driving TMDS at us. */
+	v4l2_subdev_call(dev->sd, core, s_power, 0);
 
-	pr_info(KBUILD_MODNAME ": USB is suspend\n");
+	dev->totals.pm_suspends++;
+	dprintk(1, "%s() %s suspend\n", __func__, PMSG_IS_AUTO(message) ? "runtime" : "system");
 
 	return 0;
 }
@@ -762,7 +1867,51 @@ static int hdcapm_resume(struct usb_interface *interface)
 	if (!dev)
 		return 0;
 
-	/* TODO: Power on the HDMI receiver? */
+	/* We can't trust the register shadows across a suspend. */
+	hdcapm_shadow_invalidate(dev);
+
+	v4l2_subdev_call(dev->sd, core, s_power, 1);
+
+	dev->totals.pm_resumes++;
+	dev->pm_resumed = 1;
+
+	return 0;
+}
+
+/* The device lost power or was reset while suspended, the GPIO block
+ * is back at defaults and the MST3367 went into reset with it.
+ */
+static int hdcapm_reset_resume(struct usb_interface *interface)
+{
+	struct hdcapm_dev *dev = usb_get_intfdata(interface);
+	if (!dev)
+		return 0;
+
+	dev->fw_loaded = 0;
+	dev->armed = 0;
+	hdcapm_shadow_invalidate(dev);
+	hdcapm_compressor_init_gpios(dev);
+
+	return hdcapm_resume(interface);
+}
+
+/* A port reset from our own recovery path, hdcapm_core_port_reset(). Nothing is
+ * in flight, the thread doing the reset owns the device. Without these
+ * callbacks the USB core would unbind us for the reset.
+ */
+static int hdcapm_pre_reset(struct usb_interface *interface)
+{
+	return 0;
+}
+
+static int hdcapm_post_reset(struct usb_interface *interface)
+{
+	struct hdcapm_dev *dev = usb_get_intfdata(interface);
+	if (!dev)
+		return 0;
+
+	/* Everything on the device is back to power on defaults. */
+	hdcapm_shadow_invalidate(dev);
 
 	return 0;
 }
@@ -780,7 +1929,10 @@ static struct usb_driver hdcapm_usb_driver = {
 	.id_table	= hdcapm_usb_id_table,
 	.suspend	= hdcapm_suspend,
 	.resume		= hdcapm_resume,
-	.reset_resume	= hdcapm_resume,
+	.reset_resume	= hdcapm_reset_resume,
+	.pre_reset	= hdcapm_pre_reset,
+	.post_reset	= hdcapm_post_reset,
+	.supports_autosuspend = 1,
 };
 
 static int __init hdcapm_init(void)
@@ -792,16 +1944,27 @@ static int __init hdcapm_init(void)
 
 	pr_info(KBUILD_MODNAME ": driver loaded\n");
 
+	hdcapm_debugfs_init();
+
 	ret = usb_register(&hdcapm_usb_driver);
-	if (ret)
+	if (ret) {
 		pr_err(KBUILD_MODNAME ": usb_register failed, error = %d\n", ret);
+		hdcapm_debugfs_exit();
+		return ret;
+	}
 
-	return ret;
+	/* Any emulated devices requested with mock_devices=N. */
+	hdcapm_mock_init();
+
+	return 0;
 }
 
 static void __exit hdcapm_exit(void)
 {
+	hdcapm_mock_exit();
 	usb_deregister(&hdcapm_usb_driver);
+	hdcapm_fw_cache_flush();
+	hdcapm_debugfs_exit();
 
 	pr_info(KBUILD_MODNAME ": driver unloaded\n");
 }
@@ -0,0 +1,290 @@
+/*
+ *  Driver for the Startech USB2HDCAPM USB capture device
+ *
+ *  Copyright (c) 2017 Steven Toth <stoth@kernellabs.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ */
+
+/* Diagnostics under /sys/kernel/debug/hdcapm/devN/ */
+
+#include "hdcapm.h"
+
+static struct dentry *hdcapm_debugfs_root;
+
+/* Dump the flight recorder, oldest transaction first.
+ * Writers don't stop while we read. A writer clears the slot's seq before
+ * rewriting it and publishes the new seq last, so an entry is only shown
+ * when its seq reads back the same before and after the copy.
+ */
+static int hdcapm_debugfs_flight_show(struct seq_file *m, void *data)
+{
+	struct hdcapm_dev *dev = m->private;
+	struct hdcapm_flight_entry *slot, e;
+	u32 head, seq;
+	int i;
+
+	head = atomic_read(&dev->flight_seq);
+
+	seq_printf(m, "# seq ts_ns ep len actual status duration_us\n");
+	for (i = HDCAPM_FLIGHT_ENTRIES - 1; i >= 0; i--) {
+		seq = head - i;
+		slot = &dev->flight[seq & (HDCAPM_FLIGHT_ENTRIES - 1)];
+		if (READ_ONCE(slot->seq) != seq)
+			continue;
+		smp_rmb();
+		e = *slot;
+		smp_rmb();
+		if (READ_ONCE(slot->seq) != seq || e.ts_ns == 0)
+			continue;
+
+		seq_printf(m, "%u %llu 0x%02x %u %u %d %u%s\n",
+			e.seq, e.ts_ns, e.ep, e.len, e.actual, e.status, e.duration_us,
+			e.ep == HDCAPM_FLIGHT_STALL ? " STALL" : "");
+	}
+
+	return 0;
+}
+
+static int hdcapm_debugfs_flight_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hdcapm_debugfs_flight_show, inode->i_private);
+}
+
+static const struct file_operations hdcapm_debugfs_flight_fops = {
+	.owner   = THIS_MODULE,
+	.open    = hdcapm_debugfs_flight_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/* Per endpoint counters, one line per endpoint, for monitoring to scrape.
+ * The latency columns are log2 buckets, the header names each upper bound.
+ */
+static int hdcapm_debugfs_endpoints_show(struct seq_file *m, void *data)
+{
+	static const struct {
+		int nr;
+		const char *dir;
+	} eps[] = {
+		{ PIPE_EP1 & 0x0f, "in" },
+		{ PIPE_EP2 & 0x0f, "out" },
+		{ PIPE_EP3 & 0x0f, "in" },
+		{ PIPE_EP4 & 0x0f, "out" },
+	};
+	struct hdcapm_dev *dev = m->private;
+	struct hdcapm_ep_stats s;
+	unsigned long flags;
+	int i, j;
+
+	seq_printf(m, "# ep dir xfers bytes errors timeouts");
+	for (j = 0; j < HDCAPM_EP_LAT_BUCKETS - 1; j++)
+		seq_printf(m, " lt%uus", 1 << j);
+	seq_printf(m, " more\n");
+
+	for (i = 0; i < ARRAY_SIZE(eps); i++) {
+		spin_lock_irqsave(&dev->ep_stats_lock, flags);
+		s = dev->ep_stats[eps[i].nr];
+		spin_unlock_irqrestore(&dev->ep_stats_lock, flags);
+
+		seq_printf(m, "ep%d %s %llu %llu %llu %llu", eps[i].nr, eps[i].dir,
+			s.xfers, s.bytes, s.errors, s.timeouts);
+		for (j = 0; j < HDCAPM_EP_LAT_BUCKETS; j++)
+			seq_printf(m, " %llu", s.lat_us[j]);
+		seq_printf(m, "\n");
+	}
+
+	return 0;
+}
+
+static int hdcapm_debugfs_endpoints_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hdcapm_debugfs_endpoints_show, inode->i_private);
+}
+
+static const struct file_operations hdcapm_debugfs_endpoints_fops = {
+	.owner   = THIS_MODULE,
+	.open    = hdcapm_debugfs_endpoints_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/* Firmware command latency, execute to idle, one line per command id.
+ * Same log2 us buckets as the endpoints file.
+ */
+static int hdcapm_debugfs_fw_commands_show(struct seq_file *m, void *data)
+{
+	static const char * const names[HDCAPM_FW_CMDS] = {
+		[HDCAPM_FW_CMD_START]     = "0x01",
+		[HDCAPM_FW_CMD_STOP]      = "0x02",
+		[HDCAPM_FW_CMD_CONFIGURE] = "0x10",
+		[HDCAPM_FW_CMD_OTHER]     = "other",
+	};
+	struct hdcapm_dev *dev = m->private;
+	int i, j;
+
+	seq_printf(m, "# cmd");
+	for (j = 0; j < HDCAPM_EP_LAT_BUCKETS - 1; j++)
+		seq_printf(m, " lt%uus", 1 << j);
+	seq_printf(m, " more\n");
+
+	for (i = 0; i < HDCAPM_FW_CMDS; i++) {
+		seq_printf(m, "%s", names[i]);
+		for (j = 0; j < HDCAPM_EP_LAT_BUCKETS; j++)
+			seq_printf(m, " %llu", dev->totals.fw_cmd_lat_us[i][j]);
+		seq_printf(m, "\n");
+	}
+
+	return 0;
+}
+
+static int hdcapm_debugfs_fw_commands_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hdcapm_debugfs_fw_commands_show, inode->i_private);
+}
+
+static const struct file_operations hdcapm_debugfs_fw_commands_fops = {
+	.owner   = THIS_MODULE,
+	.open    = hdcapm_debugfs_fw_commands_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/* Transfer sizes in use and what the calibration pass measured, KB/s. */
+static int hdcapm_debugfs_sizing_show(struct seq_file *m, void *data)
+{
+	struct hdcapm_dev *dev = m->private;
+	struct hdcapm_xfer_sizing *s = &dev->sizing;
+	int i;
+
+	seq_printf(m, "calibrated %d\n", s->calibrated);
+	seq_printf(m, "ep1_urb_bytes %u\n", s->ep1_urb_bytes);
+	seq_printf(m, "ep2_chunk_dwords %u\n", s->ep2_chunk_dwords);
+
+	if (!s->calibrated)
+		return 0;
+
+	seq_printf(m, "# ep size kbps\n");
+	for (i = 0; i < HDCAPM_CALIBRATE_SIZES && !s->ep1_skipped; i++)
+		seq_printf(m, "ep1 %u %u\n", s->ep1_candidates[i], s->ep1_kbps[i]);
+	if (s->ep1_skipped)
+		seq_printf(m, "ep1 n/a\n");
+	for (i = 0; i < HDCAPM_CALIBRATE_SIZES; i++)
+		seq_printf(m, "ep2 %u %u\n", s->ep2_candidates[i], s->ep2_kbps[i]);
+
+	return 0;
+}
+
+static int hdcapm_debugfs_sizing_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hdcapm_debugfs_sizing_show, inode->i_private);
+}
+
+static const struct file_operations hdcapm_debugfs_sizing_fops = {
+	.owner   = THIS_MODULE,
+	.open    = hdcapm_debugfs_sizing_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/* Start up timeline of the last few capture sessions, oldest first.
+ * Phases are us from the stream start request, - when never reached.
+ */
+static int hdcapm_debugfs_sessions_show(struct seq_file *m, void *data)
+{
+	struct hdcapm_dev *dev = m->private;
+	struct hdcapm_session s;
+	u32 head, seq;
+	int i, j;
+
+	head = dev->session_seq;
+
+	seq_printf(m, "# seq start_ns warm lingered start_seen fw_loaded encoder_started first_buffer first_byte\n");
+	for (i = HDCAPM_SESSIONS - 1; i >= 0; i--) {
+		seq = head - i;
+		s = dev->sessions[seq & (HDCAPM_SESSIONS - 1)];
+		if (s.seq != seq || s.start_ns == 0)
+			continue;
+
+		seq_printf(m, "%u %llu %d %d", s.seq, s.start_ns, s.warm, s.lingered);
+		for (j = 0; j < HDCAPM_PHASES; j++) {
+			if (s.phase_us[j])
+				seq_printf(m, " %u", s.phase_us[j]);
+			else
+				seq_printf(m, " -");
+		}
+		seq_printf(m, "\n");
+	}
+
+	return 0;
+}
+
+static int hdcapm_debugfs_sessions_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hdcapm_debugfs_sessions_show, inode->i_private);
+}
+
+static const struct file_operations hdcapm_debugfs_sessions_fops = {
+	.owner   = THIS_MODULE,
+	.open    = hdcapm_debugfs_sessions_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+void hdcapm_debugfs_register(struct hdcapm_dev *dev)
+{
+	char name[16];
+
+	if (!hdcapm_debugfs_root)
+		return;
+
+	snprintf(name, sizeof(name), "dev%d", dev->nr);
+	dev->debugfs = debugfs_create_dir(name, hdcapm_debugfs_root);
+	if (IS_ERR_OR_NULL(dev->debugfs)) {
+		dev->debugfs = NULL;
+		return;
+	}
+
+	debugfs_create_file("flight", 0444, dev->debugfs, dev, &hdcapm_debugfs_flight_fops);
+	debugfs_create_file("endpoints", 0444, dev->debugfs, dev, &hdcapm_debugfs_endpoints_fops);
+	debugfs_create_file("sizing", 0444, dev->debugfs, dev, &hdcapm_debugfs_sizing_fops);
+	debugfs_create_file("fw_commands", 0444, dev->debugfs, dev, &hdcapm_debugfs_fw_commands_fops);
+	debugfs_create_file("sessions", 0444, dev->debugfs, dev, &hdcapm_debugfs_sessions_fops);
+#ifdef HDCAPM_EVAL
+	hdcapm_eval_register(dev);
+#endif
+}
+
+void hdcapm_debugfs_unregister(struct hdcapm_dev *dev)
+{
+	debugfs_remove_recursive(dev->debugfs);
+	dev->debugfs = NULL;
+}
+
+/* Debugfs is optional, the driver carries on without it. */
+void hdcapm_debugfs_init(void)
+{
+	hdcapm_debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	if (IS_ERR(hdcapm_debugfs_root))
+		hdcapm_debugfs_root = NULL;
+}
+
+void hdcapm_debugfs_exit(void)
+{
+	debugfs_remove_recursive(hdcapm_debugfs_root);
+	hdcapm_debugfs_root = NULL;
+}
@@ -0,0 +1,218 @@
+/*
+ *  Driver for the Startech USB2HDCAPM USB capture device
+ *
+ *  Copyright (c) 2017 Steven Toth <stoth@kernellabs.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ */
+
+/* Status read microbenchmark, only built with 'make HDCAPM_EVAL=1'.
+ *
+ * Times the register status block read as the driver originally did it
+ * (kzalloc a reply, usb_bulk_msg through a shared xferbuf, memcpy, build
+ * each dword byte by byte) against hdcapm_read32_array(). It needs the
+ * real USB transport, run it with the device idle (nothing capturing):
+ *
+ *  echo 1000 > /sys/kernel/debug/hdcapm/dev0/status_read_eval
+ *  cat /sys/kernel/debug/hdcapm/dev0/status_read_eval
+ */
+
+#include "hdcapm.h"
+
+#define EVAL_XFERBUF_SIZE (65536 * 4)
+
+struct hdcapm_eval_result {
+	u32 iterations;
+	s64 baseline_ns;
+	s64 prealloc_ns;
+	int baseline_err;
+	int prealloc_err;
+};
+
+/* Only one device is normally attached, results are shared. */
+static DEFINE_MUTEX(eval_lock);
+static struct hdcapm_eval_result eval_result;
+
+/* The original hdcapm_core_ep_send(), minus the length check. */
+static int eval_ep_send(struct hdcapm_dev *dev, u8 *xferbuf, int endpoint, u8 *buf, u32 len, u32 timeout)
+{
+	int writelength;
+
+	memcpy(xferbuf, buf, len);
+
+	return usb_bulk_msg(dev->udev, usb_sndbulkpipe(dev->udev, endpoint), xferbuf, len, &writelength, timeout);
+}
+
+/* The original hdcapm_core_ep_recv(). */
+static int eval_ep_recv(struct hdcapm_dev *dev, u8 *xferbuf, int endpoint, u8 *buf, u32 len, u32 *actual, u32 timeout)
+{
+	int xferbuf_len = 0;
+	int ret;
+
+	ret = usb_bulk_msg(dev->udev, usb_rcvbulkpipe(dev->udev, endpoint), xferbuf, len, &xferbuf_len, timeout);
+
+	memcpy(buf, xferbuf, xferbuf_len);
+	*actual = xferbuf_len;
+
+	return ret;
+}
+
+/* The original hdcapm_read32_array(). */
+static int eval_read32_array_baseline(struct hdcapm_dev *dev, u8 *xferbuf, u32 addr, u32 wordcount, u32 *arr, int le_to_cpu)
+{
+	u32 len;
+	int i, j, ret;
+	int readlenbytes = wordcount * sizeof(u32);
+	u8 *rx;
+
+	/* EP4 Host -> 01 00 07 00 B0 06 00 00 */
+	u8 tx[] = {
+		0x01,
+		0x00, /* Read */
+		wordcount,
+		0x00,
+		addr,
+		addr >>  8,
+		addr >> 16,
+		addr >> 24,
+	};
+
+	rx = kzalloc(readlenbytes, GFP_KERNEL);
+	if (!rx)
+		return -ENOMEM;
+
+	/* Flush this to EP4 via a write, read N DWORDS from EP 3. */
+	hdcapm_core_usb_lock(dev);
+	ret = eval_ep_send(dev, xferbuf, PIPE_EP4, &tx[0], sizeof(tx), 1000);
+	if (ret == 0)
+		ret = eval_ep_recv(dev, xferbuf, PIPE_EP3, rx, readlenbytes, &len, 1000);
+	hdcapm_core_usb_unlock(dev);
+	if (ret < 0 || len != readlenbytes) {
+		kfree(rx);
+		return -EIO;
+	}
+
+	for (i = 0, j = 0; i < len; i += 4, j++) {
+		*(arr + j) = rx[i + 0] | (rx[i + 1] << 8) | (rx[i + 2] << 16) | (rx[i + 3] << 24);
+		if (le_to_cpu)
+			*(arr + j) = le32_to_cpu(*(arr + j));
+	}
+
+	kfree(rx);
+	return 0;
+}
+
+static int hdcapm_eval_status_read(struct hdcapm_dev *dev, u32 iterations)
+{
+	struct hdcapm_eval_result r = { .iterations = iterations };
+	ktime_t start;
+	u8 *xferbuf;
+	u32 arr[7];
+	u32 i;
+	int ret;
+
+	/* usb_bulk_msg() needs a USB device, the mock has none. */
+	if (!dev->udev)
+		return -ENODEV;
+
+	xferbuf = kzalloc(EVAL_XFERBUF_SIZE, GFP_KERNEL);
+	if (!xferbuf)
+		return -ENOMEM;
+
+	ret = hdcapm_core_pm_get(dev);
+	if (ret < 0) {
+		kfree(xferbuf);
+		return ret;
+	}
+
+	start = ktime_get();
+	for (i = 0; i < iterations; i++)
+		if (eval_read32_array_baseline(dev, xferbuf, REG_06B0, ARRAY_SIZE(arr), &arr[0], 1) < 0)
+			r.baseline_err++;
+	r.baseline_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	start = ktime_get();
+	for (i = 0; i < iterations; i++)
+		if (hdcapm_read32_array(dev, REG_06B0, ARRAY_SIZE(arr), &arr[0], 1) < 0)
+			r.prealloc_err++;
+	r.prealloc_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	hdcapm_core_pm_put(dev);
+	kfree(xferbuf);
+
+	mutex_lock(&eval_lock);
+	eval_result = r;
+	mutex_unlock(&eval_lock);
+
+	pr_info(KBUILD_MODNAME ": status read eval, %u iterations: baseline %lld ns/call (%d errors), preallocated %lld ns/call (%d errors)\n",
+		iterations,
+		div_s64(r.baseline_ns, iterations), r.baseline_err,
+		div_s64(r.prealloc_ns, iterations), r.prealloc_err);
+
+	return 0;
+}
+
+static int hdcapm_eval_show(struct seq_file *m, void *data)
+{
+	struct hdcapm_eval_result r;
+
+	mutex_lock(&eval_lock);
+	r = eval_result;
+	mutex_unlock(&eval_lock);
+
+	seq_printf(m, "# path iterations ns_per_call errors\n");
+	if (!r.iterations)
+		return 0;
+
+	seq_printf(m, "baseline %u %lld %d\n", r.iterations, div_s64(r.baseline_ns, r.iterations), r.baseline_err);
+	seq_printf(m, "preallocated %u %lld %d\n", r.iterations, div_s64(r.prealloc_ns, r.iterations), r.prealloc_err);
+
+	return 0;
+}
+
+static int hdcapm_eval_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hdcapm_eval_show, inode->i_private);
+}
+
+static ssize_t hdcapm_eval_write(struct file *file, const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	struct hdcapm_dev *dev = ((struct seq_file *)file->private_data)->private;
+	u32 iterations;
+	int ret;
+
+	ret = kstrtou32_from_user(ubuf, count, 0, &iterations);
+	if (ret < 0)
+		return ret;
+	if (iterations == 0)
+		return -EINVAL;
+
+	ret = hdcapm_eval_status_read(dev, iterations);
+	if (ret < 0)
+		return ret;
+
+	return count;
+}
+
+static const struct file_operations hdcapm_eval_fops = {
+	.owner   = THIS_MODULE,
+	.open    = hdcapm_eval_open,
+	.read    = seq_read,
+	.write   = hdcapm_eval_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+void hdcapm_eval_register(struct hdcapm_dev *dev)
+{
+	debugfs_create_file("status_read_eval", 0644, dev->debugfs, dev, &hdcapm_eval_fops);
+}
@@ -0,0 +1,140 @@
+/*
+ *  Driver for the Startech USB2HDCAPM USB capture device
+ *
+ *  Copyright (c) 2017 Steven Toth <stoth@kernellabs.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ */
+
+/* Module wide cache of the validated firmware images. Every device uploads
+ * the same two files on every capture start, load them once and share them.
+ * The cache holds one reference per image, each upload in progress holds
+ * another, so a flush never pulls an image out from under an upload.
+ */
+
+#include "hdcapm.h"
+
+#define HDCAPM_FW_CACHE_ENTRIES 2
+
+static DEFINE_MUTEX(hdcapm_fw_cache_lock);
+static struct hdcapm_fw_image *hdcapm_fw_cache[HDCAPM_FW_CACHE_ENTRIES];
+
+static int hdcapm_fw_cache_reload_set(const char *val, const struct kernel_param *kp)
+{
+	hdcapm_fw_cache_flush();
+	return 0;
+}
+
+static const struct kernel_param_ops hdcapm_fw_cache_reload_ops = {
+	.set = hdcapm_fw_cache_reload_set,
+};
+module_param_cb(fw_cache_reload, &hdcapm_fw_cache_reload_ops, NULL, 0200);
+MODULE_PARM_DESC(fw_cache_reload, "write 1 to drop the cached firmware images, the next capture reloads them");
+
+static void hdcapm_fw_release(struct kref *kref)
+{
+	struct hdcapm_fw_image *img = container_of(kref, struct hdcapm_fw_image, kref);
+
+	release_firmware(img->fw);
+	kfree(img);
+}
+
+/* Find name in the cache, or load and validate it against len. Returns a
+ * referenced image, drop it with hdcapm_fw_put(). ERR_PTR on failure, with
+ * request_firmware()'s error (-ENOENT when the file doesn't exist).
+ */
+struct hdcapm_fw_image *hdcapm_fw_get(struct hdcapm_dev *dev, const char *name, size_t len)
+{
+	struct hdcapm_fw_image *img;
+	int free = -1;
+	int ret, i;
+
+	mutex_lock(&hdcapm_fw_cache_lock);
+
+	for (i = 0; i < HDCAPM_FW_CACHE_ENTRIES; i++) {
+		img = hdcapm_fw_cache[i];
+		if (!img) {
+			if (free < 0)
+				free = i;
+			continue;
+		}
+		if (strcmp(img->name, name) == 0) {
+			kref_get(&img->kref);
+			mutex_unlock(&hdcapm_fw_cache_lock);
+			dev->totals.fw_cache_hits++;
+			return img;
+		}
+	}
+
+	dev->totals.fw_cache_misses++;
+
+	img = kzalloc(sizeof(*img), GFP_KERNEL);
+	if (!img) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	ret = request_firmware(&img->fw, name, dev->parent);
+	if (ret) {
+		/* A missing file is the caller's call, it may be optional. */
+		if (ret != -ENOENT)
+			pr_err(KBUILD_MODNAME ": failed to load firmware %s, ret = %d\n", name, ret);
+		goto fail_free;
+	}
+
+	if (img->fw->size != len) {
+		pr_err(KBUILD_MODNAME ": failed firmware length check on %s\n", name);
+		ret = -EINVAL;
+		goto fail_release;
+	}
+
+	strlcpy(img->name, name, sizeof(img->name));
+	kref_init(&img->kref);
+	pr_info(KBUILD_MODNAME ": loaded firmware %s size %zu bytes.\n", name, img->fw->size);
+
+	/* The cache keeps a reference, the caller gets the other. */
+	if (free >= 0) {
+		kref_get(&img->kref);
+		hdcapm_fw_cache[free] = img;
+	}
+
+	mutex_unlock(&hdcapm_fw_cache_lock);
+	return img;
+
+fail_release:
+	release_firmware(img->fw);
+fail_free:
+	kfree(img);
+fail:
+	mutex_unlock(&hdcapm_fw_cache_lock);
+	return ERR_PTR(ret);
+}
+
+void hdcapm_fw_put(struct hdcapm_fw_image *img)
+{
+	kref_put(&img->kref, hdcapm_fw_release);
+}
+
+/* Drop the cache's references, images still being uploaded go when their upload finishes. */
+void hdcapm_fw_cache_flush(void)
+{
+	int i;
+
+	mutex_lock(&hdcapm_fw_cache_lock);
+	for (i = 0; i < HDCAPM_FW_CACHE_ENTRIES; i++) {
+		if (hdcapm_fw_cache[i]) {
+			hdcapm_fw_put(hdcapm_fw_cache[i]);
+			hdcapm_fw_cache[i] = NULL;
+		}
+	}
+	mutex_unlock(&hdcapm_fw_cache_lock);
+}
@@ -29,16 +29,21 @@ module_param(i2c_udelay, int, 0644);
 MODULE_PARM_DESC(i2c_udelay, "i2c delay at insmod time, in usecs "
 		"(should be 5 or higher). Lower value means higher bus speed.");
 
-/* GPIO bit-banged bus */
+/* GPIO bit-banged bus.
+ * Each line transition is its own wire transaction at I2C priority, so a
+ * slow transfer on this bus never holds off the TS drain for long.
+ */
 static void hdcapm_bit_setscl(void *data, int state)
 {
 	struct hdcapm_i2c_bus *bus = data;
 	struct hdcapm_dev *dev = bus->dev;
 
+	hdcapm_core_usb_lock_class(dev, HDCAPM_SCHED_I2C);
 	if (state)
 		hdcapm_clr32(dev, REG_GPIO_OE, GPIO_SCL);
 	else
 		hdcapm_set32(dev, REG_GPIO_OE, GPIO_SCL);
+	hdcapm_core_usb_unlock(dev);
 }
 
 static void hdcapm_bit_setsda(void *data, int state)
@@ -46,10 +51,12 @@ static void hdcapm_bit_setsda(void *data, int state)
 	struct hdcapm_i2c_bus *bus = data;
 	struct hdcapm_dev *dev = bus->dev;
 
+	hdcapm_core_usb_lock_class(dev, HDCAPM_SCHED_I2C);
 	if (state)
 		hdcapm_clr32(dev, REG_GPIO_OE, GPIO_SDA);
 	else
 		hdcapm_set32(dev, REG_GPIO_OE, GPIO_SDA);
+	hdcapm_core_usb_unlock(dev);
 }
 
 static int hdcapm_bit_getscl(void *data)
@@ -58,7 +65,9 @@ static int hdcapm_bit_getscl(void *data)
 	struct hdcapm_dev *dev = bus->dev;
 	u32 val;
 
+	hdcapm_core_usb_lock_class(dev, HDCAPM_SCHED_I2C);
 	hdcapm_read32(dev, REG_GPIO_DATA_RD, &val);
+	hdcapm_core_usb_unlock(dev);
 
 	return val & GPIO_SCL ? 1 : 0;
 }
@@ -69,7 +78,9 @@ static int hdcapm_bit_getsda(void *data)
 	struct hdcapm_dev *dev = bus->dev;
 	u32 val;
 
+	hdcapm_core_usb_lock_class(dev, HDCAPM_SCHED_I2C);
 	hdcapm_read32(dev, REG_GPIO_DATA_RD, &val);
+	hdcapm_core_usb_unlock(dev);
 
 	return val & GPIO_SDA ? 1 : 0;
 }
@@ -155,10 +166,13 @@ static int i2c_write(struct i2c_adapter *i2c_adap, const struct i2c_msg *msg, in
 	return 1;
 }
 
+/* Each message owns the wire at I2C priority for its W_BUF / XACT / R_BUF
+ * sequence, the TS drain and firmware commands can get in between messages.
+ */
 static int i2c_xfer(struct i2c_adapter *i2c_adap, struct i2c_msg *msgs, int num)
 {
-	//struct hdcapm_i2c_bus *bus = i2c_adap->algo_data;
-	//struct hdcapm_dev *dev = bus->dev;
+	struct hdcapm_i2c_bus *bus = i2c_adap->algo_data;
+	struct hdcapm_dev *dev = bus->dev;
 	int ret = 0;
 	int i;
 
@@ -167,20 +181,20 @@ static int i2c_xfer(struct i2c_adapter *i2c_adap, struct i2c_msg *msgs, int num)
 	for (i = 0; i < num; i++) {
 		dprintk(4, "%s(num = %d) addr = 0x%02x  len = 0x%x\n",
 			__func__, num, msgs[i].addr, msgs[i].len);
+		hdcapm_core_usb_lock_class(dev, HDCAPM_SCHED_I2C);
 		if (msgs[i].flags & I2C_M_RD) {
 
 		} else if (i + 1 < num && (msgs[i + 1].flags & I2C_M_RD) && msgs[i].addr == msgs[i + 1].addr) {
 
 			/* write then read from same address */
 			ret = i2c_writeread(i2c_adap, &msgs[i], msgs[i + 1].len);
-			if (ret < 0)
-				goto error;
 			i++;
 
 		} else {
 			/* Write */
 			ret = i2c_write(i2c_adap, &msgs[i], 0);
 		}
+		hdcapm_core_usb_unlock(dev);
 		if (ret < 0)
 			goto error;
 	}
@@ -308,7 +322,7 @@ int hdcapm_i2c_register(struct hdcapm_dev *dev, struct hdcapm_i2c_bus *bus, int
 		bus->i2c_adap = hdcapm_i2c0_adap_template;
 		bus->i2c_client = hdcapm_i2c0_client_template;
 
-		bus->i2c_adap.dev.parent = &dev->udev->dev;
+		bus->i2c_adap.dev.parent = dev->parent;
 		strlcpy(bus->i2c_adap.name, KBUILD_MODNAME, sizeof(bus->i2c_adap.name));
 
 		bus->i2c_adap.algo_data = bus;
@@ -322,7 +336,7 @@ int hdcapm_i2c_register(struct hdcapm_dev *dev, struct hdcapm_i2c_bus *bus, int
 
 		bus->i2c_algo = hdcapm_i2c1_algo_template;
 
-		bus->i2c_adap.dev.parent = &dev->udev->dev;
+		bus->i2c_adap.dev.parent = dev->parent;
 		strlcpy(bus->i2c_adap.name, KBUILD_MODNAME, sizeof(bus->i2c_adap.name));
 		bus->i2c_adap.owner = THIS_MODULE;
 		bus->i2c_algo.udelay = i2c_udelay;
@@ -337,8 +351,10 @@ int hdcapm_i2c_register(struct hdcapm_dev *dev, struct hdcapm_i2c_bus *bus, int
 
 		i2c_bit_add_bus(&bus->i2c_adap);
 
-	} else
-		BUG();
+	} else {
+		pr_err(KBUILD_MODNAME ": no such i2c bus %d\n", bus->nr);
+		return -EINVAL;
+	}
 
 
 	if (hdcapm_i2c_scan && bus->nr == 1)
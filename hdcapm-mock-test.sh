@@ -0,0 +1,113 @@
+#!/bin/sh
+#
+# Smoke test against the mock transport, no hardware required.
+# Loads the driver with one emulated device, runs a capture, then checks
+# the VIDIOC_LOG_STATUS counters and the debugfs endpoint and session
+# tables. Exits non-zero on the first failed check.
+#
+#  sudo ./hdcapm-mock-test.sh [build-dir]     (or: make mocktest)
+#
+# Needs v4l2-ctl, debugfs, and no hdcapm module loaded beforehand.
+
+BUILD=${1:-build-$(uname -p)}
+DEBUGFS=/sys/kernel/debug/hdcapm
+CAPTURE=/tmp/hdcapm-mock-test.ts
+BLOCKS=64
+
+fail() {
+	echo "FAIL: $*"
+	cleanup
+	exit 1
+}
+
+pass() {
+	echo "ok:   $*"
+}
+
+cleanup() {
+	rm -f $CAPTURE
+	rmmod hdcapm 2>/dev/null
+	rmmod mst3367 2>/dev/null
+}
+
+# Last value logged for a VIDIOC_LOG_STATUS field.
+log_status() {
+	dmesg | grep " $1: " | tail -1 | sed "s/.* $1: *//"
+}
+
+# Column N of the debugfs endpoints row for an endpoint.
+ep_column() {
+	awk -v ep=$1 -v col=$2 '$1 == ep { print $col }' $DEBUGFS/$DEVDIR/endpoints
+}
+
+[ "$(id -u)" = "0" ] || { echo "must run as root"; exit 1; }
+[ -f $BUILD/hdcapm.ko ] || { echo "no $BUILD/hdcapm.ko, build first"; exit 1; }
+grep -q "^hdcapm " /proc/modules && { echo "hdcapm is already loaded"; exit 1; }
+command -v v4l2-ctl >/dev/null || { echo "v4l2-ctl is required"; exit 1; }
+mountpoint -q /sys/kernel/debug || mount -t debugfs none /sys/kernel/debug
+
+dmesg -c >/dev/null
+modprobe v4l2-dv-timings
+insmod $BUILD/mst3367.ko || fail "insmod mst3367"
+insmod $BUILD/hdcapm.ko mock_devices=1 mock_bitrate=0 || fail "insmod hdcapm"
+
+NODE=$(dmesg | sed -n 's/.*registered device \(video[0-9]*\) \[mpeg\].*/\1/p' | tail -1)
+[ -n "$NODE" ] || fail "no video device registered"
+DEVICE=/dev/$NODE
+pass "mock device is $DEVICE"
+
+DEVDIR=$(ls $DEBUGFS 2>/dev/null | grep '^dev' | head -1)
+[ -n "$DEVDIR" ] || fail "no debugfs directory under $DEBUGFS"
+
+# Capture, the mock pumps TS as fast as the driver drains it.
+timeout 30 dd if=$DEVICE of=$CAPTURE bs=65536 count=$BLOCKS 2>/dev/null
+SIZE=$(stat -c %s $CAPTURE 2>/dev/null)
+[ "${SIZE:-0}" -gt 0 ] || fail "capture returned no data"
+pass "captured $SIZE bytes"
+
+SYNC=$(od -A n -t x1 -N 1 $CAPTURE | tr -d ' ')
+[ "$SYNC" = "47" ] || fail "capture does not start on a TS sync byte (0x$SYNC)"
+pass "capture starts on a TS sync byte"
+
+# Let the asynchronous stop finish before reading the counters.
+sleep 2
+
+v4l2-ctl -d $DEVICE --log-status >/dev/null || fail "VIDIOC_LOG_STATUS"
+
+STATE=$(log_status device_state)
+[ "$STATE" = "STOPPED" ] || fail "device_state is '$STATE' after the capture, expected STOPPED"
+pass "device_state $STATE"
+
+BUFFERS=$(log_status codec_buffers_received)
+[ "${BUFFERS:-0}" -gt 0 ] || fail "codec_buffers_received is '$BUFFERS'"
+pass "codec_buffers_received $BUFFERS"
+
+BYTES=$(log_status codec_bytes_received)
+[ "${BYTES:-0}" -ge "$SIZE" ] || fail "codec_bytes_received $BYTES is less than the $SIZE bytes read"
+pass "codec_bytes_received $BYTES"
+
+for c in recover_reset recover_failed; do
+	V=$(log_status $c)
+	[ "$V" = "0" ] || fail "$c is '$V'"
+done
+pass "no transport recovery"
+
+# endpoints: ep dir xfers bytes errors timeouts ...
+for ep in ep1 ep3 ep4; do
+	XFERS=$(ep_column $ep 3)
+	[ "${XFERS:-0}" -gt 0 ] || fail "$ep saw no transfers"
+done
+for ep in ep1 ep2 ep3 ep4; do
+	ERRORS=$(ep_column $ep 5)
+	TIMEOUTS=$(ep_column $ep 6)
+	[ "$ERRORS" = "0" ] && [ "$TIMEOUTS" = "0" ] || fail "$ep has $ERRORS errors, $TIMEOUTS timeouts"
+done
+pass "endpoint counters, ep1 $(ep_column ep1 3) transfers, $(ep_column ep1 4) bytes"
+
+# sessions: the capture has to have reached its first byte.
+FIRST=$(grep -v '^#' $DEBUGFS/$DEVDIR/sessions | tail -1 | awk '{ print $NF }')
+[ -n "$FIRST" ] && [ "$FIRST" != "-" ] || fail "no session reached the first byte"
+pass "start to first byte ${FIRST}us"
+
+cleanup
+echo "PASS"
@@ -0,0 +1,632 @@
+/*
+ *  Driver for the Startech USB2HDCAPM USB capture device
+ *
+ *  Copyright (c) 2017 Steven Toth <stoth@kernellabs.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ */
+
+/* A mock transport. Emulates just enough of the compressor firmware in
+ * memory for the driver to probe, start a capture and pump TS:
+ *  - The EP4 command protocol, EP3 replies, EP1 payload and EP2 uploads.
+ *  - The register file, chip id, GPIO readback and the FW command mailbox.
+ *  - The 0x6b0 TS buffer status block, raised at mock_bitrate.
+ *  - TS payload, an audio PES start then null packets, in the firmware's
+ *    DWORD byte order.
+ *  - The MST3367 register banks behind the internal I2C master.
+ * Nothing here touches hardware, so the pump, buffer and I2C paths can be
+ * benchmarked on any box.
+ *
+ *  insmod mst3367.ko; insmod hdcapm.ko mock_devices=1
+ */
+
+#include <linux/platform_device.h>
+#include "hdcapm.h"
+
+static unsigned int mock_devices;
+module_param(mock_devices, int, 0444);
+MODULE_PARM_DESC(mock_devices, "create N emulated devices at load time, no hardware required (def:0)");
+
+static unsigned int mock_bitrate = 20000000;
+module_param(mock_bitrate, int, 0644);
+MODULE_PARM_DESC(mock_bitrate, "emulated TS rate in bps, 0 = as fast as the pump drains it (def:20000000)");
+
+static unsigned int mock_tsb_packets = 128;
+module_param(mock_tsb_packets, int, 0444);
+MODULE_PARM_DESC(mock_tsb_packets, "TS packets per emulated firmware buffer (def:128)");
+
+#define MOCK_MAX_DEVICES 4
+#define MOCK_REGS (0x1000 / sizeof(u32))
+#define MOCK_MEM_WORDS 16
+#define MOCK_TSB_ADDR 0x00100000
+#define MOCK_TSB_MAX_PACKETS (256000 / 188)
+
+#define MOCK_EP_CMD     PIPE_EP4
+#define MOCK_EP_REPLY   PIPE_EP3
+#define MOCK_EP_PAYLOAD (USB_DIR_IN | PIPE_EP1)
+#define MOCK_EP_UPLOAD  PIPE_EP2
+
+struct hdcapm_mock_reply {
+	struct list_head list;
+	u32 len;
+	u8 data[];
+};
+
+struct hdcapm_mock {
+	struct platform_device *pdev;
+	struct hdcapm_dev *dev;
+
+	/* Everything below. */
+	spinlock_t lock;
+
+	/* Woken whenever transfers finish, see hdcapm_mock_wait(). */
+	wait_queue_head_t wait;
+
+	/* Firmware register file, 0x000 - 0xfff. */
+	u32 regs[MOCK_REGS];
+
+	/* The few words of device memory the driver writes or reads back. */
+	u32 mem_addr[MOCK_MEM_WORDS];
+	u32 mem_val[MOCK_MEM_WORDS];
+	int mem_count;
+
+	/* MST3367 behind the I2C master, four banks selected by register 0x00. */
+	u8 i2c[4][256];
+	u8 i2c_bank;
+
+	/* IN transfers waiting for data, and data waiting for IN transfers. */
+	struct list_head reply_xfers;
+	struct list_head payload_xfers;
+	struct list_head replies;
+	u32 payload_owed;	/* Bytes the last dmaread acked. */
+	u32 upload_expected;	/* Bytes the last dmawrite acked. */
+
+	/* TS generation. */
+	int streaming;
+	int tsb_ready;
+	ktime_t tsb_next;
+	u8 *payload;
+	u32 payload_len;
+};
+
+static struct hdcapm_mock *hdcapm_mock_devs[MOCK_MAX_DEVICES];
+
+static void hdcapm_mock_mem_write(struct hdcapm_mock *m, u32 addr, u32 val)
+{
+	int i;
+
+	for (i = 0; i < m->mem_count; i++) {
+		if (m->mem_addr[i] == addr) {
+			m->mem_val[i] = val;
+			return;
+		}
+	}
+
+	if (m->mem_count < MOCK_MEM_WORDS) {
+		m->mem_addr[m->mem_count] = addr;
+		m->mem_val[m->mem_count++] = val;
+	}
+}
+
+static u32 hdcapm_mock_mem_read(struct hdcapm_mock *m, u32 addr)
+{
+	int i;
+
+	for (i = 0; i < m->mem_count; i++) {
+		if (m->mem_addr[i] == addr)
+			return m->mem_val[i];
+	}
+
+	return 0;
+}
+
+/* Power on state, with the microcode booted. */
+static void hdcapm_mock_reset(struct hdcapm_mock *m)
+{
+	struct hdcapm_mock_reply *r, *n;
+
+	list_for_each_entry_safe(r, n, &m->replies, list) {
+		list_del(&r->list);
+		kfree(r);
+	}
+
+	memset(m->regs, 0, sizeof(m->regs));
+	m->regs[REG_0038 / sizeof(u32)] = 0x00010020; /* Chip id */
+
+	m->mem_count = 0;
+	hdcapm_mock_mem_write(m, 0x00000040, 0x534f5351); /* QSOS */
+	hdcapm_mock_mem_write(m, 0x00000041, 0x0002001e);
+	hdcapm_mock_mem_write(m, 0x000bc804, 0);
+
+	memset(m->i2c, 0, sizeof(m->i2c));
+	m->i2c[0][0x50] = 1; /* MST3367 chip revision */
+	m->i2c_bank = 0;
+
+	m->payload_owed = 0;
+	m->upload_expected = 0;
+	m->streaming = 0;
+	m->tsb_ready = 0;
+}
+
+/* Raise the 0x6b0 status block when the next buffer is due. */
+static void hdcapm_mock_tsb_tick(struct hdcapm_mock *m)
+{
+	if (!m->streaming || m->tsb_ready || ktime_before(ktime_get(), m->tsb_next))
+		return;
+
+	m->regs[0x6b0 / sizeof(u32)] = 0x40;
+	m->regs[0x6b4 / sizeof(u32)] = 0x83;
+	m->regs[0x6b8 / sizeof(u32)] = MOCK_TSB_ADDR;
+	m->regs[0x6c0 / sizeof(u32)] = m->payload_len / sizeof(u32);
+	m->regs[0x6c8 / sizeof(u32)] = 1;
+	m->tsb_ready = 1;
+}
+
+/* The driver acked the buffer, schedule the next one at mock_bitrate. */
+static void hdcapm_mock_tsb_ack(struct hdcapm_mock *m)
+{
+	ktime_t now = ktime_get();
+	u64 interval_us = 0;
+
+	m->regs[0x6c8 / sizeof(u32)] = 0;
+	m->tsb_ready = 0;
+
+	if (mock_bitrate)
+		interval_us = div_u64((u64)m->payload_len * 8 * 1000000, mock_bitrate);
+
+	/* Keep the average rate, but don't burst to catch up after a long stall. */
+	m->tsb_next = ktime_add_us(m->tsb_next, interval_us);
+	if (ktime_before(m->tsb_next, ktime_sub(now, ms_to_ktime(100))))
+		m->tsb_next = now;
+}
+
+static void hdcapm_mock_fw_execute(struct hdcapm_mock *m, u32 cmd)
+{
+	switch (cmd) {
+	case 0x01: /* Start */
+		m->streaming = 1;
+		m->tsb_next = ktime_get();
+		break;
+	case 0x02: /* Stop */
+		m->streaming = 0;
+		m->tsb_ready = 0;
+		m->regs[0x6c8 / sizeof(u32)] = 0;
+		break;
+	case 0x30: /* TS buffer ack */
+		hdcapm_mock_tsb_ack(m);
+		break;
+	}
+
+	m->regs[REG_FW_CMD_BUSY / sizeof(u32)] = 0;
+}
+
+/* Run an I2C master transaction. Write N bytes (register, data..) or
+ * write one and read one (9).
+ */
+static void hdcapm_mock_i2c(struct hdcapm_mock *m, u32 xact)
+{
+	u32 wbuf = m->regs[REG_I2C_W_BUF / sizeof(u32)];
+	u32 len = xact & 0x7f;
+	u8 reg = wbuf & 0xff;
+	int i;
+
+	if (len == 9) {
+		m->regs[REG_I2C_R_BUF / sizeof(u32)] = reg ? m->i2c[m->i2c_bank][reg] : m->i2c_bank;
+		return;
+	}
+
+	for (i = 1; i < len && i < sizeof(u32); i++, reg++) {
+		if (reg == 0)
+			m->i2c_bank = (wbuf >> (i * 8)) & 0x03;
+		else
+			m->i2c[m->i2c_bank][reg] = wbuf >> (i * 8);
+	}
+}
+
+static u32 hdcapm_mock_reg_read(struct hdcapm_mock *m, u32 addr)
+{
+	if (addr >= REG_06B0 && addr <= 0x6c8)
+		hdcapm_mock_tsb_tick(m);
+
+	/* Bit banged bus, a line reads high unless we drive it low. */
+	if (addr == REG_GPIO_DATA_RD)
+		return ~m->regs[REG_GPIO_OE / sizeof(u32)];
+
+	if (addr / sizeof(u32) >= MOCK_REGS)
+		return 0;
+
+	return m->regs[addr / sizeof(u32)];
+}
+
+static void hdcapm_mock_reg_write(struct hdcapm_mock *m, u32 addr, u32 val)
+{
+	if (addr / sizeof(u32) >= MOCK_REGS)
+		return;
+
+	switch (addr) {
+	case REG_I2C_XACT:
+		hdcapm_mock_i2c(m, val);
+		val &= ~(1 << 31); /* Engine idle */
+		break;
+	case REG_FW_CMD_EXECUTE:
+		m->regs[addr / sizeof(u32)] = val;
+		hdcapm_mock_fw_execute(m, val);
+		return;
+	}
+
+	m->regs[addr / sizeof(u32)] = val;
+}
+
+static int hdcapm_mock_reply(struct hdcapm_mock *m, const void *data, u32 len)
+{
+	struct hdcapm_mock_reply *r;
+
+	r = kmalloc(sizeof(*r) + len, GFP_ATOMIC);
+	if (!r)
+		return -ENOMEM;
+
+	r->len = len;
+	memcpy(r->data, data, len);
+	list_add_tail(&r->list, &m->replies);
+
+	return 0;
+}
+
+/* Decode one EP4 command, see the wire traces in -core.c. */
+static int hdcapm_mock_command(struct hdcapm_mock *m, const u8 *tx, u32 len)
+{
+	__le32 words[HDCAPM_STATUS_MAX_WORDS];
+	u32 addr;
+	u8 ack = 0;
+	int i;
+
+	if (len < 8)
+		return -EPROTO;
+
+	switch (tx[0] << 8 | tx[1]) {
+	case 0x0101: /* Register write */
+		if (len < 12)
+			return -EPROTO;
+		hdcapm_mock_reg_write(m, get_unaligned_le32(&tx[4]), get_unaligned_le32(&tx[8]));
+		return 0;
+	case 0x0100: /* Register read, N dwords */
+		if (tx[2] == 0 || tx[2] > HDCAPM_STATUS_MAX_WORDS)
+			return -EPROTO;
+		addr = get_unaligned_le32(&tx[4]);
+		for (i = 0; i < tx[2]; i++)
+			words[i] = cpu_to_le32(hdcapm_mock_reg_read(m, addr + (i * sizeof(u32))));
+		return hdcapm_mock_reply(m, words, tx[2] * sizeof(u32));
+	case 0x0201: /* Memory write */
+		if (len < 16)
+			return -EPROTO;
+		hdcapm_mock_mem_write(m, get_unaligned_le32(&tx[4]), get_unaligned_le32(&tx[12]));
+		return 0;
+	case 0x0200: /* Memory read */
+		words[0] = cpu_to_le32(hdcapm_mock_mem_read(m, get_unaligned_le32(&tx[4])));
+		return hdcapm_mock_reply(m, words, sizeof(u32));
+	case 0x0901: /* DMA write, EP2 payload follows */
+		if (len < 16)
+			return -EPROTO;
+		m->upload_expected = get_unaligned_le32(&tx[12]) * sizeof(u32);
+		return hdcapm_mock_reply(m, &ack, sizeof(ack));
+	case 0x0900: /* DMA read, EP1 payload follows */
+		if (len < 16)
+			return -EPROTO;
+		m->payload_owed = get_unaligned_le32(&tx[12]) * sizeof(u32);
+		return hdcapm_mock_reply(m, &ack, sizeof(ack));
+	}
+
+	dprintk(1, "%s() unknown command %02x %02x\n", __func__, tx[0], tx[1]);
+	return -EPROTO;
+}
+
+/* Copy len bytes of the prebuilt TS pattern into an IN transfer. */
+static void hdcapm_mock_payload_fill(struct hdcapm_mock *m, struct hdcapm_urb_xfer *xfer, u32 len)
+{
+	u32 pos, cpy;
+
+	for (pos = 0; pos < len; pos += cpy) {
+		cpy = min(len - pos, m->payload_len);
+		if (xfer->sg)
+			sg_pcopy_from_buffer(xfer->sg, xfer->num_sgs, m->payload, cpy, pos);
+		else
+			memcpy(xfer->buf + pos, m->payload, cpy);
+	}
+}
+
+/* Match waiting IN transfers with whatever the firmware has produced. */
+static void hdcapm_mock_deliver(struct hdcapm_mock *m)
+{
+	struct hdcapm_urb_xfer *xfer;
+	struct hdcapm_mock_reply *r;
+	u32 len;
+
+	while (!list_empty(&m->reply_xfers) && !list_empty(&m->replies)) {
+		xfer = list_first_entry(&m->reply_xfers, struct hdcapm_urb_xfer, list);
+		r = list_first_entry(&m->replies, struct hdcapm_mock_reply, list);
+		list_del(&xfer->list);
+		list_del(&r->list);
+
+		len = min(xfer->len, r->len);
+		memcpy(xfer->buf, r->data, len);
+		kfree(r);
+
+		hdcapm_urb_xfer_done(xfer, len, 0);
+	}
+
+	while (!list_empty(&m->payload_xfers) && m->payload_owed) {
+		xfer = list_first_entry(&m->payload_xfers, struct hdcapm_urb_xfer, list);
+		list_del(&xfer->list);
+
+		len = min(xfer->len, m->payload_owed);
+		hdcapm_mock_payload_fill(m, xfer, len);
+		m->payload_owed -= len;
+
+		hdcapm_urb_xfer_done(xfer, len, 0);
+	}
+}
+
+/* Transfers complete synchronously in the caller's context, under the mock lock. */
+static int hdcapm_mock_submit(struct hdcapm_urb_ctx *ctx, struct hdcapm_urb_xfer *xfer)
+{
+	struct hdcapm_mock *m = ctx->dev->transport_priv;
+	int ret = 0;
+
+	spin_lock(&m->lock);
+
+	switch (xfer->ep) {
+	case MOCK_EP_CMD:
+		ret = hdcapm_mock_command(m, xfer->buf, xfer->len);
+		if (ret == 0)
+			hdcapm_urb_xfer_done(xfer, xfer->len, 0);
+		break;
+	case MOCK_EP_UPLOAD:
+		if (m->upload_expected < xfer->len) {
+			/* Nobody asked for this, the real device stalls. */
+			hdcapm_urb_xfer_done(xfer, 0, -EPIPE);
+			break;
+		}
+		m->upload_expected -= xfer->len;
+		hdcapm_urb_xfer_done(xfer, xfer->len, 0);
+		break;
+	case MOCK_EP_REPLY:
+		list_add_tail(&xfer->list, &m->reply_xfers);
+		break;
+	case MOCK_EP_PAYLOAD:
+		list_add_tail(&xfer->list, &m->payload_xfers);
+		break;
+	default:
+		ret = -EINVAL;
+	}
+
+	if (ret == 0)
+		hdcapm_mock_deliver(m);
+
+	spin_unlock(&m->lock);
+
+	/* Delivery may have finished transfers queued by other callers. */
+	wake_up_all(&m->wait);
+
+	return ret;
+}
+
+static void hdcapm_mock_cancel_list(struct list_head *head, struct hdcapm_urb_ctx *ctx, int status)
+{
+	struct hdcapm_urb_xfer *xfer, *n;
+
+	list_for_each_entry_safe(xfer, n, head, list) {
+		if (ctx && xfer->ctx != ctx)
+			continue;
+		list_del(&xfer->list);
+		hdcapm_urb_xfer_done(xfer, 0, status);
+	}
+}
+
+static void hdcapm_mock_cancel(struct hdcapm_urb_ctx *ctx)
+{
+	struct hdcapm_mock *m = ctx->dev->transport_priv;
+
+	spin_lock(&m->lock);
+	hdcapm_mock_cancel_list(&m->reply_xfers, ctx, -ENOENT);
+	hdcapm_mock_cancel_list(&m->payload_xfers, ctx, -ENOENT);
+	spin_unlock(&m->lock);
+
+	wake_up_all(&m->wait);
+}
+
+/* Every transfer finishes under the mock lock, so once the count reads
+ * zero under it nobody is still inside hdcapm_urb_xfer_done() on ctx.
+ */
+static int hdcapm_mock_ctx_idle(struct hdcapm_mock *m, struct hdcapm_urb_ctx *ctx)
+{
+	int idle;
+
+	spin_lock(&m->lock);
+	idle = atomic_read(&ctx->pending) == 0;
+	spin_unlock(&m->lock);
+
+	return idle;
+}
+
+static int hdcapm_mock_wait(struct hdcapm_urb_ctx *ctx, u32 timeout)
+{
+	struct hdcapm_mock *m = ctx->dev->transport_priv;
+
+	if (timeout == 0) {
+		wait_event(m->wait, hdcapm_mock_ctx_idle(m, ctx));
+		return 0;
+	}
+
+	if (!wait_event_timeout(m->wait, hdcapm_mock_ctx_idle(m, ctx), msecs_to_jiffies(timeout)))
+		return -ETIMEDOUT;
+
+	return 0;
+}
+
+static int hdcapm_mock_sg_capable(struct hdcapm_dev *dev, struct sg_table *sgt)
+{
+	return 1;
+}
+
+/* Drop anything half way through a transaction, as a halt clear would. */
+static int hdcapm_mock_clear_halts(struct hdcapm_dev *dev)
+{
+	struct hdcapm_mock *m = dev->transport_priv;
+	struct hdcapm_mock_reply *r, *n;
+
+	spin_lock(&m->lock);
+	list_for_each_entry_safe(r, n, &m->replies, list) {
+		list_del(&r->list);
+		kfree(r);
+	}
+	m->payload_owed = 0;
+	m->upload_expected = 0;
+	spin_unlock(&m->lock);
+
+	return 0;
+}
+
+static int hdcapm_mock_port_reset(struct hdcapm_dev *dev)
+{
+	struct hdcapm_mock *m = dev->transport_priv;
+
+	spin_lock(&m->lock);
+	hdcapm_mock_cancel_list(&m->reply_xfers, NULL, -ESHUTDOWN);
+	hdcapm_mock_cancel_list(&m->payload_xfers, NULL, -ESHUTDOWN);
+	hdcapm_mock_reset(m);
+	spin_unlock(&m->lock);
+
+	wake_up_all(&m->wait);
+
+	return 0;
+}
+
+static const struct hdcapm_transport_ops hdcapm_mock_transport = {
+	.name        = "mock",
+	.submit      = hdcapm_mock_submit,
+	.cancel      = hdcapm_mock_cancel,
+	.wait        = hdcapm_mock_wait,
+	.sg_capable  = hdcapm_mock_sg_capable,
+	.clear_halts = hdcapm_mock_clear_halts,
+	.port_reset  = hdcapm_mock_port_reset,
+	.fw_optional = 1,
+};
+
+/* An audio PES start (for the warm restart check) then null packets, stored
+ * the way the firmware delivers them, byte swapped per DWORD. usb_read()
+ * swaps them back.
+ */
+static int hdcapm_mock_payload_alloc(struct hdcapm_mock *m, u32 packets)
+{
+	u8 *pkt;
+	u32 i;
+
+	m->payload_len = packets * 188;
+	m->payload = kzalloc(m->payload_len, GFP_KERNEL);
+	if (!m->payload)
+		return -ENOMEM;
+
+	for (i = 0; i < packets; i++) {
+		pkt = m->payload + (i * 188);
+		pkt[0] = 0x47;
+		pkt[1] = 0x1f;
+		pkt[2] = 0xff;
+		pkt[3] = 0x10 | (i & 0x0f);
+		memset(pkt + 4, 0xff, 188 - 4);
+	}
+
+	/* PID 0x101, payload unit start, MPEG audio stream 0xc0. */
+	pkt = m->payload;
+	pkt[1] = 0x41;
+	pkt[2] = 0x01;
+	pkt[4] = 0x00;
+	pkt[5] = 0x00;
+	pkt[6] = 0x01;
+	pkt[7] = 0xc0;
+
+	for (i = 0; i < m->payload_len; i += sizeof(u32))
+		*(u32 *)(m->payload + i) = swab32(*(u32 *)(m->payload + i));
+
+	return 0;
+}
+
+static struct hdcapm_mock *hdcapm_mock_create(int nr)
+{
+	struct hdcapm_mock *m;
+	int ret;
+
+	m = kzalloc(sizeof(*m), GFP_KERNEL);
+	if (!m)
+		return NULL;
+
+	spin_lock_init(&m->lock);
+	init_waitqueue_head(&m->wait);
+	INIT_LIST_HEAD(&m->reply_xfers);
+	INIT_LIST_HEAD(&m->payload_xfers);
+	INIT_LIST_HEAD(&m->replies);
+	hdcapm_mock_reset(m);
+
+	if (hdcapm_mock_payload_alloc(m, clamp_t(u32, mock_tsb_packets, 1, MOCK_TSB_MAX_PACKETS)) < 0)
+		goto fail1;
+
+	m->pdev = platform_device_register_simple("hdcapm-mock", nr, NULL, 0);
+	if (IS_ERR(m->pdev))
+		goto fail2;
+
+	ret = hdcapm_core_probe(&m->pdev->dev, &hdcapm_mock_transport, m, NULL, NULL, &m->dev);
+	if (ret < 0) {
+		pr_err(KBUILD_MODNAME ": mock device %d failed, ret = %d\n", nr, ret);
+		goto fail3;
+	}
+
+	return m;
+
+fail3:
+	platform_device_unregister(m->pdev);
+fail2:
+	kfree(m->payload);
+fail1:
+	kfree(m);
+	return NULL;
+}
+
+static void hdcapm_mock_destroy(struct hdcapm_mock *m)
+{
+	hdcapm_core_remove(m->dev);
+	platform_device_unregister(m->pdev);
+
+	/* Nothing is in flight once the device is gone, this just frees replies. */
+	hdcapm_mock_reset(m);
+	kfree(m->payload);
+	kfree(m);
+}
+
+int hdcapm_mock_init(void)
+{
+	int i;
+
+	for (i = 0; i < mock_devices && i < MOCK_MAX_DEVICES; i++)
+		hdcapm_mock_devs[i] = hdcapm_mock_create(i);
+
+	return 0;
+}
+
+void hdcapm_mock_exit(void)
+{
+	int i;
+
+	for (i = 0; i < MOCK_MAX_DEVICES; i++) {
+		if (hdcapm_mock_devs[i])
+			hdcapm_mock_destroy(hdcapm_mock_devs[i]);
+		hdcapm_mock_devs[i] = NULL;
+	}
+}
@@ -0,0 +1,65 @@
+/*
+ *  Driver for the Startech USB2HDCAPM USB capture device
+ *
+ *  Copyright (c) 2017 Steven Toth <stoth@kernellabs.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM hdcapm
+
+#if !defined(_HDCAPM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _HDCAPM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* One completed bulk transfer on any endpoint.
+ * echo 1 >/sys/kernel/debug/tracing/events/hdcapm/hdcapm_urb/enable
+ */
+TRACE_EVENT(hdcapm_urb,
+
+	TP_PROTO(int nr, u8 ep, u32 len, u32 actual, int status, u32 duration_us),
+
+	TP_ARGS(nr, ep, len, actual, status, duration_us),
+
+	TP_STRUCT__entry(
+		__field(int, nr)
+		__field(u8, ep)
+		__field(u32, len)
+		__field(u32, actual)
+		__field(int, status)
+		__field(u32, duration_us)
+	),
+
+	TP_fast_assign(
+		__entry->nr = nr;
+		__entry->ep = ep;
+		__entry->len = len;
+		__entry->actual = actual;
+		__entry->status = status;
+		__entry->duration_us = duration_us;
+	),
+
+	TP_printk("dev%d ep 0x%02x len %u actual %u status %d %uus",
+		__entry->nr, __entry->ep, __entry->len, __entry->actual,
+		__entry->status, __entry->duration_us)
+);
+
+#endif /* _HDCAPM_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hdcapm-trace
+#include <trace/define_trace.h>
@@ -0,0 +1,455 @@
+/*
+ *  Driver for the Startech USB2HDCAPM USB capture device
+ *
+ *  Copyright (c) 2017 Steven Toth <stoth@kernellabs.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ */
+
+/* Asynchronous bulk transfer engine.
+ *
+ * Callers prepare a hdcapm_urb_ctx, queue any number of bulk transfers
+ * against it (EP4 commands, EP3 replies, EP1/EP2 payload), then call
+ * hdcapm_urb_wait() once. Transfers are handed to the device transport
+ * (dev->ops), the USB backend at the bottom of this file anchors every
+ * URB to the context so a timeout can kill whatever is still in flight.
+ *
+ * Contexts live on the caller's stack, so the wait belongs to the
+ * transport: only it knows when it has stopped touching the context. The
+ * USB core still uses the anchor after a URB's completion handler returns,
+ * so the USB backend waits for the anchor itself to go idle. The first
+ * non-zero URB status is latched and returned by hdcapm_urb_wait().
+ *
+ * A context is single use, initialize it again before reusing it.
+ */
+
+#include "hdcapm.h"
+
+#define CREATE_TRACE_POINTS
+#include "hdcapm-trace.h"
+
+/* Latch an error into the context, the first one wins. */
+void hdcapm_urb_ctx_error(struct hdcapm_urb_ctx *ctx, int status)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	if (ctx->status == 0)
+		ctx->status = status;
+	spin_unlock_irqrestore(&ctx->lock, flags);
+}
+
+/* Record a transaction in the per device flight recorder. Safe from any
+ * context, writers claim a slot with a single atomic increment and never
+ * wait for each other or for readers. The slot's seq is cleared before
+ * the rewrite and published last, see hdcapm_debugfs_flight_show().
+ */
+void hdcapm_flight_record(struct hdcapm_dev *dev, u8 ep, u32 len, u32 actual, int status, u32 duration_us)
+{
+	struct hdcapm_flight_entry *e;
+	u32 seq;
+
+	seq = atomic_inc_return(&dev->flight_seq);
+	e = &dev->flight[seq & (HDCAPM_FLIGHT_ENTRIES - 1)];
+
+	WRITE_ONCE(e->seq, 0);
+	smp_wmb();
+
+	e->ts_ns = ktime_get_ns();
+	e->duration_us = duration_us;
+	e->len = len;
+	e->actual = actual;
+	e->status = status;
+	e->ep = ep;
+
+	smp_wmb();
+	WRITE_ONCE(e->seq, seq);
+}
+
+/* Account a finished transfer against its endpoint. Safe from any context. */
+void hdcapm_ep_stats_record(struct hdcapm_dev *dev, u8 ep, u32 actual, int status, int timedout, u32 duration_us)
+{
+	struct hdcapm_ep_stats *s = &dev->ep_stats[(ep & 0x0f) % HDCAPM_EP_STATS];
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->ep_stats_lock, flags);
+	s->xfers++;
+	s->bytes += actual;
+	if (status && timedout)
+		s->timeouts++;
+	else
+	if (status)
+		s->errors++;
+	s->lat_us[min_t(u32, fls(duration_us), HDCAPM_EP_LAT_BUCKETS - 1)]++;
+	spin_unlock_irqrestore(&dev->ep_stats_lock, flags);
+}
+
+/* Every transport finishes every submitted transfer through here, exactly
+ * once, from any context.
+ */
+void hdcapm_urb_xfer_done(struct hdcapm_urb_xfer *xfer, u32 actual, int status)
+{
+	struct hdcapm_urb_ctx *ctx = xfer->ctx;
+	struct hdcapm_dev *dev = ctx->dev;
+	u32 duration_us;
+
+	duration_us = ktime_us_delta(ktime_get(), xfer->submitted);
+	hdcapm_flight_record(dev, xfer->ep, xfer->len, actual, status, duration_us);
+	trace_hdcapm_urb(dev->nr, xfer->ep, xfer->len, actual, status, duration_us);
+	hdcapm_ep_stats_record(dev, xfer->ep, actual, status, ctx->timedout, duration_us);
+
+	if (status == 0 && xfer->copyto)
+		memcpy(xfer->copyto, xfer->buf, actual);
+
+	/* Accumulates, so a payload split over several URBs sums up. */
+	if (xfer->actual)
+		*xfer->actual += actual;
+
+	if (status)
+		hdcapm_urb_ctx_error(ctx, status);
+
+	if (xfer->bounced)
+		kfree(xfer->buf);
+
+	/* Preallocated transfers belong to the caller. */
+	if (!xfer->urb)
+		kfree(xfer);
+
+	/* Don't touch ctx after this, see the transport's wait. */
+	atomic_dec(&ctx->pending);
+}
+
+void hdcapm_urb_ctx_init(struct hdcapm_dev *dev, struct hdcapm_urb_ctx *ctx)
+{
+	ctx->dev = dev;
+	ctx->status = 0;
+	ctx->timedout = 0;
+	atomic_set(&ctx->pending, 0);
+	spin_lock_init(&ctx->lock);
+	init_usb_anchor(&ctx->anchor);
+}
+
+/* Hand a described transfer to the transport. On failure the transfer,
+ * and any bounce buffer, are released here.
+ */
+static int hdcapm_urb_queue(struct hdcapm_urb_ctx *ctx, struct hdcapm_urb_xfer *xfer)
+{
+	int ret;
+
+	atomic_inc(&ctx->pending);
+	xfer->submitted = ktime_get();
+
+	/* The transport may complete it before returning, don't touch xfer after success. */
+	ret = ctx->dev->ops->submit(ctx, xfer);
+	if (ret < 0) {
+		atomic_dec(&ctx->pending);
+		hdcapm_urb_ctx_error(ctx, ret);
+		if (xfer->bounced)
+			kfree(xfer->buf);
+		if (!xfer->urb)
+			kfree(xfer);
+	}
+
+	return ret;
+}
+
+static void hdcapm_urb_fill(struct hdcapm_urb_ctx *ctx, struct hdcapm_urb_xfer *xfer, int endpoint, int in,
+	u8 *buf, struct scatterlist *sg, u32 nents, u32 len, u8 *copyto, u32 *actual, int bounced)
+{
+	xfer->ctx = ctx;
+	xfer->ep = (endpoint & 0x0f) | (in ? USB_DIR_IN : 0);
+	xfer->buf = buf;
+	xfer->sg = sg;
+	xfer->num_sgs = nents;
+	xfer->len = len;
+	xfer->bounced = bounced;
+	xfer->copyto = copyto;
+	xfer->actual = actual;
+}
+
+static int hdcapm_urb_submit(struct hdcapm_urb_ctx *ctx, int endpoint, int in,
+	u8 *buf, struct scatterlist *sg, u32 nents, u32 len, u8 *copyto, u32 *actual, int bounced)
+{
+	struct hdcapm_urb_xfer *xfer;
+
+	xfer = kzalloc(sizeof(*xfer), GFP_KERNEL);
+	if (!xfer) {
+		if (bounced)
+			kfree(buf);
+		hdcapm_urb_ctx_error(ctx, -ENOMEM);
+		return -ENOMEM;
+	}
+
+	hdcapm_urb_fill(ctx, xfer, endpoint, in, buf, sg, nents, len, copyto, actual, bounced);
+
+	return hdcapm_urb_queue(ctx, xfer);
+}
+
+/* Allocate a transfer that can be submitted over and over without touching
+ * the allocator, for hot paths such as status polling. Only one submission
+ * may be in flight at a time.
+ */
+struct hdcapm_urb_xfer *hdcapm_urb_xfer_alloc(void)
+{
+	struct hdcapm_urb_xfer *xfer;
+
+	xfer = kzalloc(sizeof(*xfer), GFP_KERNEL);
+	if (!xfer)
+		return NULL;
+
+	xfer->urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!xfer->urb) {
+		kfree(xfer);
+		return NULL;
+	}
+
+	return xfer;
+}
+
+void hdcapm_urb_xfer_free(struct hdcapm_urb_xfer *xfer)
+{
+	if (!xfer)
+		return;
+
+	usb_free_urb(xfer->urb);
+	kfree(xfer);
+}
+
+/* Queue a preallocated bulk OUT transfer, buf must be DMA capable. */
+int hdcapm_urb_send_xfer(struct hdcapm_urb_ctx *ctx, struct hdcapm_urb_xfer *xfer, int endpoint, u8 *buf, u32 len)
+{
+	hdcapm_urb_fill(ctx, xfer, endpoint, 0, buf, NULL, 0, len, NULL, NULL, 0);
+	return hdcapm_urb_queue(ctx, xfer);
+}
+
+/* Queue a preallocated bulk IN transfer, buf must be DMA capable. */
+int hdcapm_urb_recv_xfer(struct hdcapm_urb_ctx *ctx, struct hdcapm_urb_xfer *xfer, int endpoint, u8 *buf, u32 len, u32 *actual)
+{
+	hdcapm_urb_fill(ctx, xfer, endpoint, 1, buf, NULL, 0, len, NULL, actual, 0);
+	return hdcapm_urb_queue(ctx, xfer);
+}
+
+/* Queue a bulk OUT transfer. buf must be DMA capable (not on stack, not vmalloc)
+ * and remain untouched until hdcapm_urb_wait() returns.
+ */
+int hdcapm_urb_send(struct hdcapm_urb_ctx *ctx, int endpoint, u8 *buf, u32 len)
+{
+	return hdcapm_urb_submit(ctx, endpoint, 0, buf, NULL, 0, len, NULL, NULL, 0);
+}
+
+/* Queue a bulk IN transfer directly into a DMA capable buffer. */
+int hdcapm_urb_recv(struct hdcapm_urb_ctx *ctx, int endpoint, u8 *buf, u32 len, u32 *actual)
+{
+	return hdcapm_urb_submit(ctx, endpoint, 1, buf, NULL, 0, len, NULL, actual, 0);
+}
+
+/* Queue a bulk OUT transfer from any buffer (typically on stack), the payload
+ * is copied into a bounce buffer so the caller may reuse buf immediately.
+ */
+int hdcapm_urb_send_copy(struct hdcapm_urb_ctx *ctx, int endpoint, const u8 *buf, u32 len)
+{
+	u8 *bounce;
+
+	bounce = kmemdup(buf, len, GFP_KERNEL);
+	if (!bounce) {
+		hdcapm_urb_ctx_error(ctx, -ENOMEM);
+		return -ENOMEM;
+	}
+
+	return hdcapm_urb_submit(ctx, endpoint, 0, bounce, NULL, 0, len, NULL, NULL, 1);
+}
+
+/* Queue a bulk IN transfer through a bounce buffer. The payload is copied
+ * into buf on completion, so buf must remain valid until hdcapm_urb_wait().
+ */
+int hdcapm_urb_recv_copy(struct hdcapm_urb_ctx *ctx, int endpoint, u8 *buf, u32 len, u32 *actual)
+{
+	u8 *bounce;
+
+	bounce = kmalloc(len, GFP_KERNEL);
+	if (!bounce) {
+		hdcapm_urb_ctx_error(ctx, -ENOMEM);
+		return -ENOMEM;
+	}
+
+	return hdcapm_urb_submit(ctx, endpoint, 1, bounce, NULL, 0, len, buf, actual, 1);
+}
+
+/* Can the transport take this sg table as a single transfer? */
+int hdcapm_urb_sg_capable(struct hdcapm_dev *dev, struct sg_table *sgt)
+{
+	return dev->ops->sg_capable(dev, sgt);
+}
+
+/* Queue a bulk IN transfer into nents entries of a scatter-gather list,
+ * check hdcapm_urb_sg_capable() first.
+ */
+int hdcapm_urb_recv_sg(struct hdcapm_urb_ctx *ctx, int endpoint, struct scatterlist *sg, u32 nents, u32 len, u32 *actual)
+{
+	return hdcapm_urb_submit(ctx, endpoint, 1, NULL, sg, nents, len, NULL, actual, 0);
+}
+
+/* Kill anything still in flight, the context status reflects the cancellation. */
+void hdcapm_urb_cancel(struct hdcapm_urb_ctx *ctx)
+{
+	ctx->dev->ops->cancel(ctx);
+}
+
+/* Wait for every transfer queued on the context, up to timeout ms (0 = forever).
+ * Returns 0 on success, -ETIMEDOUT or the first URB error otherwise.
+ */
+int hdcapm_urb_wait(struct hdcapm_urb_ctx *ctx, u32 timeout)
+{
+	if (ctx->dev->ops->wait(ctx, timeout) < 0) {
+		/* Mark the stall in the flight recorder, before the kills land in it. */
+		hdcapm_flight_record(ctx->dev, HDCAPM_FLIGHT_STALL, 0, 0, -ETIMEDOUT, timeout * 1000);
+		pr_err_ratelimited(KBUILD_MODNAME ": dev%d transfer stalled for %dms, see debugfs hdcapm/dev%d/flight\n",
+			ctx->dev->nr, timeout, ctx->dev->nr);
+		ctx->timedout = 1;
+		hdcapm_urb_cancel(ctx);
+		ctx->dev->ops->wait(ctx, 0);
+		return -ETIMEDOUT;
+	}
+
+	return ctx->status;
+}
+
+/* ----------------------------------------------------------------------- */
+
+/* The USB transport, the default. */
+
+/* Called in interrupt context by the host controller. */
+static void hdcapm_usb_complete(struct urb *urb)
+{
+	hdcapm_urb_xfer_done(urb->context, urb->actual_length, urb->status);
+}
+
+static int hdcapm_usb_submit(struct hdcapm_urb_ctx *ctx, struct hdcapm_urb_xfer *xfer)
+{
+	struct usb_device *udev = ctx->dev->udev;
+	struct urb *urb = xfer->urb;
+	unsigned int pipe;
+	int ret;
+
+	if (!urb) {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb)
+			return -ENOMEM;
+	}
+
+	if (xfer->ep & USB_DIR_IN)
+		pipe = usb_rcvbulkpipe(udev, xfer->ep & 0x0f);
+	else
+		pipe = usb_sndbulkpipe(udev, xfer->ep);
+
+	usb_fill_bulk_urb(urb, udev, pipe, xfer->buf, xfer->len, hdcapm_usb_complete, xfer);
+	if (xfer->sg) {
+		urb->sg = xfer->sg;
+		urb->num_sgs = xfer->num_sgs;
+	}
+
+	usb_anchor_urb(urb, &ctx->anchor);
+	ret = usb_submit_urb(urb, GFP_KERNEL);
+	if (ret < 0)
+		usb_unanchor_urb(urb);
+
+	/* The anchor and the host controller hold their own references. */
+	if (!xfer->urb)
+		usb_free_urb(urb);
+
+	return ret;
+}
+
+static void hdcapm_usb_cancel(struct hdcapm_urb_ctx *ctx)
+{
+	usb_kill_anchored_urbs(&ctx->anchor);
+}
+
+/* An URB leaves the anchor before its completion handler runs, but the
+ * anchor's wakeups stay suspended until the USB core is done with it,
+ * so an idle anchor means no URB on ctx will touch ctx again.
+ */
+static int hdcapm_usb_wait(struct hdcapm_urb_ctx *ctx, u32 timeout)
+{
+	if (timeout == 0) {
+		while (!usb_wait_anchor_empty_timeout(&ctx->anchor, 1000))
+			;
+		return 0;
+	}
+
+	return usb_wait_anchor_empty_timeout(&ctx->anchor, timeout) ? 0 : -ETIMEDOUT;
+}
+
+/* Can the host controller take this sg table as a single URB? */
+static int hdcapm_usb_sg_capable(struct hdcapm_dev *dev, struct sg_table *sgt)
+{
+	struct usb_bus *bus = dev->udev->bus;
+
+	return bus->sg_tablesize > 0 && (bus->no_sg_constraint || bus->sg_tablesize >= sgt->nents);
+}
+
+/* Clear any halt/stall condition on our bulk endpoints. */
+static int hdcapm_usb_clear_halts(struct hdcapm_dev *dev)
+{
+	const unsigned int pipes[] = {
+		usb_sndbulkpipe(dev->udev, PIPE_EP4),
+		usb_rcvbulkpipe(dev->udev, PIPE_EP3),
+		usb_rcvbulkpipe(dev->udev, PIPE_EP1),
+		usb_sndbulkpipe(dev->udev, PIPE_EP2),
+	};
+	int i, ret = 0;
+
+	for (i = 0; i < ARRAY_SIZE(pipes); i++) {
+		if (usb_clear_halt(dev->udev, pipes[i]) < 0) {
+			pr_err(KBUILD_MODNAME ": clear halt failed on endpoint %d\n", usb_pipeendpoint(pipes[i]));
+			ret = -EIO;
+		}
+	}
+
+	return ret;
+}
+
+static int hdcapm_usb_port_reset(struct hdcapm_dev *dev)
+{
+	int ret;
+
+	ret = usb_lock_device_for_reset(dev->udev, dev->intf);
+	if (ret < 0)
+		return ret;
+
+	ret = usb_reset_device(dev->udev);
+	usb_unlock_device(dev->udev);
+
+	return ret;
+}
+
+static int hdcapm_usb_pm_get(struct hdcapm_dev *dev)
+{
+	return usb_autopm_get_interface(dev->intf);
+}
+
+static void hdcapm_usb_pm_put(struct hdcapm_dev *dev)
+{
+	usb_autopm_put_interface(dev->intf);
+}
+
+const struct hdcapm_transport_ops hdcapm_usb_transport = {
+	.name        = "usb",
+	.submit      = hdcapm_usb_submit,
+	.cancel      = hdcapm_usb_cancel,
+	.wait        = hdcapm_usb_wait,
+	.sg_capable  = hdcapm_usb_sg_capable,
+	.clear_halts = hdcapm_usb_clear_halts,
+	.port_reset  = hdcapm_usb_port_reset,
+	.pm_get      = hdcapm_usb_pm_get,
+	.pm_put      = hdcapm_usb_pm_put,
+};
@@ -154,7 +154,10 @@ static int vidioc_querycap(struct file *file, void  *priv, struct v4l2_capabilit
 
 	strcpy(cap->driver, KBUILD_MODNAME);
 	strlcpy(cap->card, dev->name, sizeof(cap->card));
-	usb_make_path(dev->udev, cap->bus_info, sizeof(cap->bus_info));
+	if (dev->udev)
+		usb_make_path(dev->udev, cap->bus_info, sizeof(cap->bus_info));
+	else
+		snprintf(cap->bus_info, sizeof(cap->bus_info), "platform:%s", dev_name(dev->parent));
 
 	cap->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_READWRITE; //| V4L2_CAP_AUDIO;
 	cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
@@ -176,8 +179,10 @@ static int vidioc_log_status(struct file *file, void *priv)
 	struct hdcapm_fh *fh = file->private_data;
 	struct hdcapm_dev *dev = fh->dev;
 	struct hdcapm_statistics *s = dev->stats;
+	struct hdcapm_totals *t = &dev->totals;
 	u64 q_used_bytes, q_used_items;
 	struct hdcapm_encoder_parameters *p = &dev->encoder_parameters;
+	int i;
 
 	v4l2_info(&dev->v4l2_dev, "device_state:           %s\n",
 		dev->state == STATE_START ? "START" :
@@ -190,6 +195,48 @@ static int vidioc_log_status(struct file *file, void *priv)
 	v4l2_info(&dev->v4l2_dev, "codec_bytes_received:   %llu\n", s->codec_bytes_received);
 	v4l2_info(&dev->v4l2_dev, "codec_ts_not_yet_ready: %llu\n", s->codec_ts_not_yet_ready);
 	v4l2_info(&dev->v4l2_dev, "buffer_overrun:         %llu\n", s->buffer_overrun);
+	v4l2_info(&dev->v4l2_dev, "shadow_hits:            %llu\n", s->shadow_hits);
+	v4l2_info(&dev->v4l2_dev, "shadow_misses:          %llu\n", s->shadow_misses);
+	v4l2_info(&dev->v4l2_dev, "xferpool_contention:    %llu\n", s->xferpool_contention);
+	v4l2_info(&dev->v4l2_dev, "sched_contention:       data %llu fw %llu i2c %llu\n",
+		s->sched_contention[HDCAPM_SCHED_DATA],
+		s->sched_contention[HDCAPM_SCHED_FW],
+		s->sched_contention[HDCAPM_SCHED_I2C]);
+	v4l2_info(&dev->v4l2_dev, "pm_suspends:            %llu\n", t->pm_suspends);
+	v4l2_info(&dev->v4l2_dev, "pm_resumes:             %llu\n", t->pm_resumes);
+	v4l2_info(&dev->v4l2_dev, "recover_clear_halt:     %llu\n", s->recover_clear_halt);
+	v4l2_info(&dev->v4l2_dev, "recover_resync:         %llu\n", s->recover_resync);
+	v4l2_info(&dev->v4l2_dev, "recover_reset:          %llu\n", s->recover_reset);
+	v4l2_info(&dev->v4l2_dev, "recover_failed:         %llu\n", s->recover_failed);
+	v4l2_info(&dev->v4l2_dev, "warm_starts:            %llu\n", t->warm_starts);
+	v4l2_info(&dev->v4l2_dev, "warm_fallbacks:         %llu\n", t->warm_fallbacks);
+	v4l2_info(&dev->v4l2_dev, "prearm_starts:          %llu\n", t->prearm_starts);
+	v4l2_info(&dev->v4l2_dev, "armed:                  %d\n", dev->armed);
+	v4l2_info(&dev->v4l2_dev, "lingering:              %d\n", dev->lingering);
+	v4l2_info(&dev->v4l2_dev, "linger_resumes:         %llu\n", t->linger_resumes);
+	v4l2_info(&dev->v4l2_dev, "start_queued:           %llu\n", t->start_queued);
+	v4l2_info(&dev->v4l2_dev, "fw_cache_hits:          %llu\n", t->fw_cache_hits);
+	v4l2_info(&dev->v4l2_dev, "fw_cache_misses:        %llu\n", t->fw_cache_misses);
+	v4l2_info(&dev->v4l2_dev, "fw_upload:              %llu bytes in %llu us (%llu KB/s)\n",
+		t->fw_upload_bytes, t->fw_upload_us,
+		t->fw_upload_us ? div64_u64(t->fw_upload_bytes * 1000000, t->fw_upload_us * 1024) : 0);
+	v4l2_info(&dev->v4l2_dev, "fw_idle_reads:          %llu\n", t->fw_idle_reads);
+	v4l2_info(&dev->v4l2_dev, "fw_idle_sleeps:         %llu\n", t->fw_idle_sleeps);
+	for (i = 0; i < HDCAPM_FW_SCRIPTS; i++) {
+		struct hdcapm_fw_script_timing *last = &dev->fw_script_last[i];
+		u32 j;
+
+		if (!last->name)
+			continue;
+
+		v4l2_info(&dev->v4l2_dev, "fw_script %-9s:    %u cmds, %u idle polls, %u us\n",
+			last->name, last->count, last->idle_polls, last->total_us);
+		for (j = 0; j < last->count && j < HDCAPM_FW_SCRIPT_MAX_CMDS; j++)
+			v4l2_info(&dev->v4l2_dev, "  cmd 0x%08x:        %u us\n", last->cmd[j], last->cmd_us[j]);
+	}
+	v4l2_info(&dev->v4l2_dev, "xfer_sizing:            ep1 urb %u bytes, ep2 chunk 0x%x dwords%s\n",
+		dev->sizing.ep1_urb_bytes, dev->sizing.ep2_chunk_dwords,
+		!dev->sizing.calibrated ? "" : dev->sizing.ep1_skipped ? " (calibrated, ep1 n/a)" : " (calibrated)");
 
 	if (p->output_width && p->output_height) {
 		v4l2_info(&dev->v4l2_dev, "video_scaler_output:    %dx%d\n",
@@ -206,10 +253,22 @@ static int vidioc_log_status(struct file *file, void *priv)
 	kl_histogram_print_v4l2_device(&dev->v4l2_dev, &s->usb_read_call_interval);
 	kl_histogram_print_v4l2_device(&dev->v4l2_dev, &s->usb_read_sleeping);
 	kl_histogram_print_v4l2_device(&dev->v4l2_dev, &s->usb_codec_transfer);
+	kl_histogram_print_v4l2_device(&dev->v4l2_dev, &s->usb_codec_transfer_ack);
+	kl_histogram_print_v4l2_device(&dev->v4l2_dev, &s->usb_codec_transfer_payload);
 	kl_histogram_print_v4l2_device(&dev->v4l2_dev, &s->usb_buffer_handoff);
 	kl_histogram_print_v4l2_device(&dev->v4l2_dev, &s->usb_buffer_acquire);
 	kl_histogram_print_v4l2_device(&dev->v4l2_dev, &s->usb_codec_status);
 	kl_histogram_print_v4l2_device(&dev->v4l2_dev, &s->v4l2_read_call_interval);
+	kl_histogram_print_v4l2_device(&dev->v4l2_dev, &s->xferpool_wait);
+	for (i = 0; i < HDCAPM_SCHED_CLASSES; i++)
+		kl_histogram_print_v4l2_device(&dev->v4l2_dev, &s->sched_wait[i]);
+	kl_histogram_print_v4l2_device(&dev->v4l2_dev, &s->capture_interrupted);
+	kl_histogram_print_v4l2_device(&dev->v4l2_dev, &t->pm_resume);
+	kl_histogram_print_v4l2_device(&dev->v4l2_dev, &t->fw_upload);
+	kl_histogram_print_v4l2_device(&dev->v4l2_dev, &t->fw_ready_wait);
+	kl_histogram_print_v4l2_device(&dev->v4l2_dev, &t->compressor_start);
+	for (i = 0; i < HDCAPM_FW_SCRIPTS; i++)
+		kl_histogram_print_v4l2_device(&dev->v4l2_dev, &t->fw_script[i]);
 #if TIMER_EVAL
 	kl_histogram_print_v4l2_device(&dev->v4l2_dev, &s->timer_callbacks);
 	kl_histogram_print_v4l2_device(&dev->v4l2_dev, &s->hrtimer_callbacks);
@@ -432,6 +491,7 @@ static int fops_open(struct file *file)
 {
 	struct hdcapm_dev *dev;
 	struct hdcapm_fh *fh;
+	int ret;
 
 	dev = (struct hdcapm_dev *)video_get_drvdata(video_devdata(file));
 	if (!dev)
@@ -444,11 +504,35 @@ static int fops_open(struct file *file)
 	if (NULL == fh)
 		return -ENOMEM;
 
+	/* Let a capture stop still in progress finish first, our ioctls would
+	 * otherwise race its receiver re-init. A read queues behind it anyway.
+	 */
+	if (!(file->f_flags & O_NONBLOCK)) {
+		ret = hdcapm_core_wait_stopped(dev);
+		if (ret < 0) {
+			kfree(fh);
+			return ret;
+		}
+	}
+
+	/* Wake the device, it stays up until the last close. */
+	ret = hdcapm_core_pm_get(dev);
+	if (ret < 0) {
+		kfree(fh);
+		return ret;
+	}
+
 	fh->dev = dev;
 	v4l2_fh_init(&fh->fh, video_devdata(file));
 	file->private_data = &fh->fh;
 	v4l2_fh_add(&fh->fh);
 
+	/* Let the thread resume polling the HDMI receiver. */
+	if (atomic_inc_return(&dev->users) == 1) {
+		dev->prearm_spent = 0;
+		wake_up(&dev->thread_wait);
+	}
+
 	return 0;
 }
 
@@ -471,6 +555,11 @@ static int fops_release(struct file *file)
 	v4l2_fh_exit(&fh->fh);
 	kfree(fh);
 
+	/* Have the thread tear down a pre-armed encoder. */
+	if (atomic_dec_return(&dev->users) == 0 && dev->armed)
+		wake_up(&dev->thread_wait);
+	hdcapm_core_pm_put(dev);
+
 	return 0;
 }
 
@@ -530,6 +619,7 @@ static ssize_t fops_read(struct file *file, char __user *buffer,
 		}
 
 		ubuf->readpos += cnt;
+		hdcapm_core_session_mark(dev, HDCAPM_PHASE_FIRST_BYTE);
 		count -= cnt;
 		buffer += cnt;
 		ret += cnt;
@@ -29,11 +29,19 @@
 #include <linux/kdev_t.h>
 #include <linux/kthread.h>
 #include <linux/freezer.h>
+#include <linux/pm_runtime.h>
 #include <linux/usb.h>
+#include <linux/vmalloc.h>
+#include <linux/scatterlist.h>
+#include <linux/highmem.h>
+#include <asm/unaligned.h>
+#include <linux/sched/task_stack.h>
+#include <asm/sections.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/firmware.h>
 #include <linux/timer.h>
+#include <linux/debugfs.h>
 #include <media/v4l2-common.h>
 #include <media/v4l2-ctrls.h>
 #include <media/v4l2-ioctl.h>
@@ -122,6 +130,260 @@ struct hdcapm_fh {
 	atomic_t v4l_reading;
 };
 
+/* One bulk transfer, as handed to the transport. Normally allocated per
+ * submission and freed on completion, preallocated ones (urb != NULL) are
+ * owned and reused by the caller.
+ */
+struct hdcapm_urb_xfer {
+	struct hdcapm_urb_ctx *ctx;
+
+	/* For the flight recorder and tracepoint. */
+	ktime_t submitted;
+	u8 ep; /* Endpoint number, USB_DIR_IN set for IN transfers. */
+
+	/* The payload, either buf or (IN only) num_sgs entries from sg. A bounce buf is freed on completion. */
+	u8 *buf;
+	struct scatterlist *sg;
+	u32 num_sgs;
+	u32 len;
+	int bounced;
+
+	/* When bounced, the IN payload is copied back here on completion. */
+	u8 *copyto;
+	u32 *actual;
+
+	/* Preallocated, see hdcapm_urb_xfer_alloc(). */
+	struct urb *urb;
+
+	/* Free for the transport to queue the transfer on, see -mock.c. */
+	struct list_head list;
+};
+
+/* A group of bulk transfers queued together and waited on once, see -urb.c */
+struct hdcapm_urb_ctx {
+	struct hdcapm_dev *dev;
+	struct usb_anchor anchor;
+	atomic_t pending; /* Transfers not yet finished, dropped last in hdcapm_urb_xfer_done(). */
+	spinlock_t lock;
+	int status; /* First error reported by any transfer in the group. */
+	int timedout; /* hdcapm_urb_wait() gave up, the cancellations are timeouts. */
+};
+
+/* How a device moves bulk transfers. The USB backend (-urb.c) is the default,
+ * the mock backend (-mock.c) emulates the firmware in memory.
+ */
+struct hdcapm_transport_ops {
+	const char *name;
+
+	/* Start one transfer and finish it later, or before returning, with
+	 * hdcapm_urb_xfer_done(). An error return means it never started.
+	 */
+	int  (*submit)(struct hdcapm_urb_ctx *ctx, struct hdcapm_urb_xfer *xfer);
+
+	/* Finish everything still in flight on ctx, with an error status. */
+	void (*cancel)(struct hdcapm_urb_ctx *ctx);
+
+	/* Wait up to timeout ms (0 = forever) until the transport is done with
+	 * every transfer on ctx and won't touch ctx again, it usually lives on
+	 * the caller's stack. 0 when idle, -ETIMEDOUT otherwise.
+	 */
+	int  (*wait)(struct hdcapm_urb_ctx *ctx, u32 timeout);
+
+	int  (*sg_capable)(struct hdcapm_dev *dev, struct sg_table *sgt);
+	int  (*clear_halts)(struct hdcapm_dev *dev);
+	int  (*port_reset)(struct hdcapm_dev *dev);
+
+	/* Runtime PM references, optional. get resumes the device if needed. */
+	int  (*pm_get)(struct hdcapm_dev *dev);
+	void (*pm_put)(struct hdcapm_dev *dev);
+
+	/* The device boots without the firmware images, a missing file isn't fatal. */
+	int  fw_optional;
+};
+
+/* Bulk transfer sizes, defaults or the result of the calibration pass
+ * in hdcapm_compressor_register() (calibrate_xfer).
+ */
+#define HDCAPM_CALIBRATE_SIZES 4
+struct hdcapm_xfer_sizing {
+	u32 ep1_urb_bytes;	/* TS payload split into URBs of this size, 0 = one URB */
+	u32 ep2_chunk_dwords;	/* Firmware upload dmawrite size */
+	int calibrated;
+	int ep1_skipped;	/* EP1 not measured, ep1_urb_bytes only applies to pipelined_dmaread */
+
+	/* What the calibration measured for each candidate, KB/s. */
+	u32 ep1_candidates[HDCAPM_CALIBRATE_SIZES];
+	u32 ep1_kbps[HDCAPM_CALIBRATE_SIZES];
+	u32 ep2_candidates[HDCAPM_CALIBRATE_SIZES];
+	u32 ep2_kbps[HDCAPM_CALIBRATE_SIZES];
+};
+
+/* Largest status block hdcapm_read32_array() reads in one transaction. */
+#define HDCAPM_STATUS_MAX_WORDS 16
+
+/* Back-to-back register transactions pipelined on a single URB context.
+ * Read results are only valid after hdcapm_batch_commit() returns 0.
+ */
+#define HDCAPM_BATCH_MAX_READS 16
+struct hdcapm_batch {
+	struct hdcapm_urb_ctx ctx;
+	u32 count;
+	u32 nr_reads;
+	u32 *reads[HDCAPM_BATCH_MAX_READS];
+	u32 actual[HDCAPM_BATCH_MAX_READS];
+};
+
+/* A write-through cached copy of a driver owned register. */
+#define HDCAPM_SHADOW_REGS 4
+struct hdcapm_shadow_reg {
+	u32 addr;
+	u32 val;
+	int valid;
+};
+
+/* A bounce buffer for USB transfers that can't be DMA'd from the callers memory.
+ * Small slots serve register and I2C traffic, the single large slot serves
+ * bulk payload, so a control transfer never waits behind a big one.
+ */
+#define HDCAPM_XFERPOOL_SMALL 4
+#define HDCAPM_XFERPOOL_SMALL_SIZE 1024
+#define HDCAPM_XFERPOOL_COUNT (HDCAPM_XFERPOOL_SMALL + 1)
+struct hdcapm_xferbuf {
+	u8  *ptr;
+	u32  size;
+	int  busy;
+};
+
+/* The last N bulk transactions, always recorded, dumped via debugfs. */
+#define HDCAPM_FLIGHT_ENTRIES 256 /* Power of two */
+#define HDCAPM_FLIGHT_STALL 0xff /* Pseudo endpoint, a wait timed out */
+struct hdcapm_flight_entry {
+	u32 seq;
+	u64 ts_ns;
+	u32 duration_us;
+	u32 len;
+	u32 actual;
+	s32 status;
+	u8  ep;
+};
+
+/* Firmware command scripts, see firmware_transition(). */
+enum {
+	HDCAPM_FW_SCRIPT_START = 0,
+	HDCAPM_FW_SCRIPT_STOP,
+	HDCAPM_FW_SCRIPT_CONFIGURE,
+	HDCAPM_FW_SCRIPTS
+};
+#define HDCAPM_FW_SCRIPT_MAX_CMDS 16
+
+/* Firmware command ids with their own latency histogram. */
+enum {
+	HDCAPM_FW_CMD_START = 0,	/* 0x01 */
+	HDCAPM_FW_CMD_STOP,		/* 0x02 */
+	HDCAPM_FW_CMD_CONFIGURE,	/* 0x10 */
+	HDCAPM_FW_CMD_OTHER,
+	HDCAPM_FW_CMDS
+};
+
+/* Timing of the last run of a script, total and per command. */
+struct hdcapm_fw_script_timing {
+	const char *name;
+	u32 count;
+	u32 idle_polls;
+	u32 total_us;
+	u32 cmd[HDCAPM_FW_SCRIPT_MAX_CMDS];
+	u32 cmd_us[HDCAPM_FW_SCRIPT_MAX_CMDS];
+};
+
+/* Start up timeline of the last N capture sessions, dumped via debugfs.
+ * Each phase is us since the stream start request, 0 when not reached.
+ */
+#define HDCAPM_SESSIONS 8 /* Power of two */
+enum {
+	HDCAPM_PHASE_START_SEEN = 0,	/* Thread picked up STATE_START */
+	HDCAPM_PHASE_FW_LOADED,		/* Firmware uploaded, or warm restarted */
+	HDCAPM_PHASE_ENCODER_STARTED,	/* firmware_transition() start script done */
+	HDCAPM_PHASE_FIRST_BUFFER,	/* First TS buffer on the used list */
+	HDCAPM_PHASE_FIRST_BYTE,	/* First byte copied out to user space */
+	HDCAPM_PHASES
+};
+struct hdcapm_session {
+	u32 seq;
+	u64 start_ns;
+	u32 phase_us[HDCAPM_PHASES];
+	u8  warm;
+	u8  lingered;	/* Picked up a lingering encoder, nothing to bring up. */
+};
+
+/* Per endpoint transfer counters, indexed by endpoint number, never reset.
+ * Latency bucket i counts transfers that took [2^(i-1), 2^i) us, the last
+ * bucket takes everything longer.
+ */
+#define HDCAPM_EP_STATS 5
+#define HDCAPM_EP_LAT_BUCKETS 24
+struct hdcapm_ep_stats {
+	u64 xfers;
+	u64 bytes;
+	u64 errors;
+	u64 timeouts;
+	u64 lat_us[HDCAPM_EP_LAT_BUCKETS];
+};
+
+/* Device lifetime counters, never reset, see hdcapm_core_totals_init(). */
+struct hdcapm_totals {
+	/* Captures started without a firmware reload, and those that lost audio and reloaded anyway. */
+	u64 warm_starts;
+	u64 warm_fallbacks;
+
+	/* Captures that found the encoder pre-armed. */
+	u64 prearm_starts;
+
+	/* Reads that picked up a lingering encoder, and starts queued behind a stop. */
+	u64 linger_resumes;
+	u64 start_queued;
+
+	/* Firmware images served from the module wide cache vs. loaded. */
+	u64 fw_cache_hits;
+	u64 fw_cache_misses;
+
+	/* Firmware upload, bytes and time spent pushing them. */
+	u64 fw_upload_bytes;
+	u64 fw_upload_us;
+
+	/* Runtime PM transitions. */
+	u64 pm_suspends;
+	u64 pm_resumes;
+
+	/* Firmware busy flag reads, and sleeps between them, waiting for a command to retire. */
+	u64 fw_idle_reads;
+	u64 fw_idle_sleeps;
+
+	struct kl_histogram pm_resume;
+	struct kl_histogram fw_upload;
+	struct kl_histogram fw_ready_wait;
+	struct kl_histogram compressor_start;
+	struct kl_histogram fw_script[HDCAPM_FW_SCRIPTS];
+
+	/* Firmware command latency, execute to idle, log2 us buckets as for hdcapm_ep_stats. */
+	u64 fw_cmd_lat_us[HDCAPM_FW_CMDS][HDCAPM_EP_LAT_BUCKETS];
+};
+
+/* Wire arbitration classes, highest priority first. See hdcapm_core_usb_lock_class(). */
+enum hdcapm_sched_class_e {
+	HDCAPM_SCHED_DATA = 0,	/* TS payload drain, usb_read(). */
+	HDCAPM_SCHED_FW,	/* Firmware commands and general register access. */
+	HDCAPM_SCHED_I2C,	/* MST3367 / Sonix I2C traffic. */
+	HDCAPM_SCHED_CLASSES
+};
+
+struct hdcapm_sched {
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	struct task_struct *owner;
+	int depth; /* Nested acquisitions by the owner. */
+	int waiting[HDCAPM_SCHED_CLASSES];
+};
+
 struct hdcapm_i2c_bus {
 	struct hdcapm_dev *dev;
 	int nr;
@@ -139,7 +401,20 @@ struct hdcapm_dev {
 	int thread_active;
         struct task_struct *kthread;
 
+	/* The thread sleeps here while the device is idle, see hdcapm_thread_idle(). */
+	wait_queue_head_t thread_wait;
+
+	/* Open file handles, the device may autosuspend when there are none. */
+	atomic_t users;
+
+	/* Set by the resume callback, consumed by hdcapm_core_pm_get() to time it. */
+	int pm_resumed;
+
 	struct hdcapm_statistics *stats;
+	struct hdcapm_totals totals;
+
+	/* Instance number, in probe order. */
+	int nr;
 
 	/* Held by the follow driver features.
 	 * 1. During probe and disconnect.
@@ -147,11 +422,87 @@ struct hdcapm_dev {
 	 */
 	struct mutex lock;
 
+	/* Transport, see struct hdcapm_transport_ops. udev and intf are NULL
+	 * unless it's the USB backend, everything else uses parent.
+	 */
+	const struct hdcapm_transport_ops *ops;
+	void *transport_priv;
+	struct device *parent;
 	struct usb_device *udev;
+	struct usb_interface *intf;
+
+	/* Preallocated status read path, see hdcapm_read32_array(). Protected by usb_lock. */
+	u8 *status_tx;
+	__le32 *status_rx;
+	struct hdcapm_urb_xfer *status_txfer;
+	struct hdcapm_urb_xfer *status_rxfer;
+
+	/* Register shadows, see hdcapm_shadow_enable(). */
+	spinlock_t shadow_lock;
+	u32 shadow_count;
+	struct hdcapm_shadow_reg shadow[HDCAPM_SHADOW_REGS];
+
+	/* We need to xfer USB buffers off the stack, borrow one from this pool.
+	 * DMA capable buffers (kmalloc) bypass this and go zero copy.
+	 * Protected by xferpool_lock, waiters sleep on xferpool_wait.
+	 */
+	spinlock_t xferpool_lock;
+	wait_queue_head_t xferpool_wait;
+	struct hdcapm_xferbuf xferpool[HDCAPM_XFERPOOL_COUNT];
+
+	/* Serializes a firmware transaction on the wire, an EP4 command and
+	 * its EP3 ack / EP1 / EP2 payload, so the pump thread, I2C and ioctl
+	 * paths can't interleave their replies. Waiters are granted the wire
+	 * by class priority, not arrival order.
+	 */
+	struct hdcapm_sched sched;
+
+	struct hdcapm_xfer_sizing sizing;
+
+	/* The codec firmware is resident from a previous capture, see warm_restart.
+	 * Cleared by anything that resets the device.
+	 */
+	int fw_loaded;
+	int warm_failed;	/* A warm start lost audio once, always reload. */
+	int audio_seen;		/* An audio PES went by this capture. */
+
+	/* Capture start / stop hand off with the thread, see hdcapm_core_start_streaming().
+	 * A start that lands during a stop is queued in start_pending. stop_done
+	 * completes each time the thread finishes a stop.
+	 */
+	struct mutex state_lock;
+	struct completion stop_done;
+	int start_pending;
+	int lingering;		/* Last reader gone, encoder kept running, see linger. */
+	unsigned long linger_expires;
+
+	/* Encoder configured ahead of the first read, see prearm. Cleared by a
+	 * stop and by anything that reloads the firmware.
+	 */
+	int armed;
+	int armed_warm;		/* The firmware came up through a warm restart. */
+	int prearm_spent;	/* Armed once since the first open, don't again. */
+	unsigned long armed_expires;
+
+	/* Last run of each firmware command script, kept across captures. */
+	struct hdcapm_fw_script_timing fw_script_last[HDCAPM_FW_SCRIPTS];
+
+	/* hdcapm_mem_fill32() fills whole ranges: 0 untested, 1 yes, -1 no. */
+	int mem_fill;
+
+	/* Flight recorder, see hdcapm_flight_record(). */
+	atomic_t flight_seq;
+	struct hdcapm_flight_entry flight[HDCAPM_FLIGHT_ENTRIES];
+
+	/* See hdcapm_ep_stats_record(), dumped via debugfs. */
+	spinlock_t ep_stats_lock;
+	struct hdcapm_ep_stats ep_stats[HDCAPM_EP_STATS];
+
+	/* See hdcapm_core_session_mark(), dumped via debugfs. */
+	u32 session_seq;
+	struct hdcapm_session sessions[HDCAPM_SESSIONS];
 
-	/* We need to xfer USB buffers off the stack, put them here. */
-	u8  *xferbuf;
-	u32  xferbuf_len;
+	struct dentry *debugfs;
 
 	/* I2C.
 	 * Bus0 - MST3367.
@@ -186,12 +537,19 @@ struct hdcapm_buffer {
 	struct hdcapm_dev *dev;
 	struct urb        *urb;
 
+	/* Either kmalloc'd, so the EP1 payload can be DMA'd straight into it,
+	 * or (buffer_sg) a vmap of single pages, transferred through sgt.
+	 */
 	u8  *ptr;
+	struct page **pages;
+	u32 nr_pages;
+	struct sg_table sgt;
 	u32  maxsize;
 	u32  actual_size;
 	u32  readpos;
 };
 
+/* Per capture statistics, reset by every hdcapm_compressor_run(). */
 struct hdcapm_statistics {
 
 	/* Number of times the driver stole a used buffer to satisfy a free buffer streaming request. */
@@ -206,15 +564,34 @@ struct hdcapm_statistics {
 	/* Any time we call the codec to check for a TS buffer, and it replies that it doesn't yet have one. */
 	u64 codec_ts_not_yet_ready;
 
+	/* RMW helpers served from a register shadow vs. having to read the hardware. */
+	u64 shadow_hits;
+	u64 shadow_misses;
+
+	/* Transport recovery, how often each escalation step fired and how often it all failed. */
+	u64 recover_clear_halt;
+	u64 recover_resync;
+	u64 recover_reset;
+	u64 recover_failed;
+
+	/* Callers that had to sleep for a transfer pool buffer, or for another transaction on the wire. */
+	u64 xferpool_contention;
+	u64 sched_contention[HDCAPM_SCHED_CLASSES];
+
 	struct kl_histogram usb_read_call_interval;
 	struct kl_histogram usb_read_sleeping;
 	struct kl_histogram usb_codec_transfer;
+	struct kl_histogram usb_codec_transfer_ack;
+	struct kl_histogram usb_codec_transfer_payload;
 	struct kl_histogram usb_codec_status;
 	struct kl_histogram usb_buffer_handoff;
 	struct kl_histogram usb_buffer_acquire;
 	struct kl_histogram timer_callbacks;
 	struct kl_histogram hrtimer_callbacks;
 	struct kl_histogram v4l2_read_call_interval;
+	struct kl_histogram xferpool_wait;
+	struct kl_histogram sched_wait[HDCAPM_SCHED_CLASSES];
+	struct kl_histogram capture_interrupted;
 };
 static __inline__ void hdcapm_core_statistics_reset(struct hdcapm_dev *dev)
 {
@@ -226,14 +603,35 @@ static __inline__ void hdcapm_core_statistics_reset(struct hdcapm_dev *dev)
 	kl_histogram_reset(&s->usb_buffer_handoff, "usb buffer full handoff", KL_BUCKET_VIDEO);
 	kl_histogram_reset(&s->usb_buffer_acquire, "usb buffer free acquire", KL_BUCKET_VIDEO);
 	kl_histogram_reset(&s->usb_codec_transfer, "usb codec transfer", KL_BUCKET_VIDEO);
+	kl_histogram_reset(&s->usb_codec_transfer_ack, "usb codec transfer ack", KL_BUCKET_VIDEO);
+	kl_histogram_reset(&s->usb_codec_transfer_payload, "usb codec transfer payload", KL_BUCKET_VIDEO);
 	kl_histogram_reset(&s->usb_codec_status, "usb codec status read", KL_BUCKET_VIDEO);
 	kl_histogram_reset(&s->v4l2_read_call_interval, "v4l2 read() call interval", KL_BUCKET_VIDEO);
+	kl_histogram_reset(&s->xferpool_wait, "usb xfer pool contended wait", KL_BUCKET_VIDEO);
+	kl_histogram_reset(&s->sched_wait[HDCAPM_SCHED_DATA], "usb sched wait (data)", KL_BUCKET_VIDEO);
+	kl_histogram_reset(&s->sched_wait[HDCAPM_SCHED_FW], "usb sched wait (fw)", KL_BUCKET_VIDEO);
+	kl_histogram_reset(&s->sched_wait[HDCAPM_SCHED_I2C], "usb sched wait (i2c)", KL_BUCKET_VIDEO);
+	kl_histogram_reset(&s->capture_interrupted, "capture interrupted by recovery", KL_BUCKET_VIDEO);
 #if TIMER_EVAL
 	kl_histogram_reset(&s->timer_callbacks, "timer cb intervals (1ms)", KL_BUCKET_VIDEO);
 	kl_histogram_reset(&s->hrtimer_callbacks, "hrtimer cb intervals (4ms)", KL_BUCKET_VIDEO);
 #endif
 }
 
+static __inline__ void hdcapm_core_totals_init(struct hdcapm_dev *dev)
+{
+	struct hdcapm_totals *t = &dev->totals;
+
+	memset(t, 0, sizeof(*t));
+	kl_histogram_reset(&t->pm_resume, "runtime resume on demand", KL_BUCKET_VIDEO);
+	kl_histogram_reset(&t->fw_upload, "firmware image upload", KL_BUCKET_VIDEO);
+	kl_histogram_reset(&t->fw_ready_wait, "firmware ready wait", KL_BUCKET_VIDEO);
+	kl_histogram_reset(&t->compressor_start, "compressor start latency", KL_BUCKET_VIDEO);
+	kl_histogram_reset(&t->fw_script[HDCAPM_FW_SCRIPT_START], "fw script start", KL_BUCKET_VIDEO);
+	kl_histogram_reset(&t->fw_script[HDCAPM_FW_SCRIPT_STOP], "fw script stop", KL_BUCKET_VIDEO);
+	kl_histogram_reset(&t->fw_script[HDCAPM_FW_SCRIPT_CONFIGURE], "fw script configure", KL_BUCKET_VIDEO);
+}
+
 /* -core.c */
 int hdcapm_write32(struct hdcapm_dev *dev, u32 addr, u32 val);
 int hdcapm_read32(struct hdcapm_dev *dev, u32 addr, u32 *val);
@@ -241,12 +639,44 @@ int hdcapm_read32(struct hdcapm_dev *dev, u32 addr, u32 *val);
 /* Read N DWORDS from the firmware and optionally convert the LE firmware dwords to platform CPU DWORDS. */
 int hdcapm_read32_array(struct hdcapm_dev *dev, u32 addr, u32 wordcount, u32 *arr, int le_to_cpu);
 
+/* Queue a sequence of register writes/reads and submit them pipelined, commit returns the first error. */
+void hdcapm_batch_begin(struct hdcapm_dev *dev, struct hdcapm_batch *b);
+int hdcapm_batch_write32(struct hdcapm_batch *b, u32 addr, u32 val);
+int hdcapm_batch_read32(struct hdcapm_batch *b, u32 addr, u32 *val);
+int hdcapm_batch_commit(struct hdcapm_batch *b);
+
+/* Transport recovery, see hdcapm_compressor_recover(). */
+int hdcapm_core_clear_halts(struct hdcapm_dev *dev);
+int hdcapm_core_port_reset(struct hdcapm_dev *dev);
+
+/* Runtime PM, a reference keeps the device out of autosuspend. */
+int hdcapm_core_pm_get(struct hdcapm_dev *dev);
+void hdcapm_core_pm_put(struct hdcapm_dev *dev);
+
+/* Start up timeline, see HDCAPM_PHASE_*. */
+void hdcapm_core_session_mark(struct hdcapm_dev *dev, int phase);
+
+/* Serialize a multi-stage firmware transaction (EP4 command, EP3 ack, EP1/EP2 payload).
+ * Nests for the owner. The plain variant arbitrates as HDCAPM_SCHED_FW.
+ */
+void hdcapm_core_usb_lock_class(struct hdcapm_dev *dev, int class);
+void hdcapm_core_usb_lock(struct hdcapm_dev *dev);
+void hdcapm_core_usb_unlock(struct hdcapm_dev *dev);
+
+/* Opt a driver owned register into the write-through shadow cache used by set32/clr32. */
+int hdcapm_shadow_enable(struct hdcapm_dev *dev, u32 addr);
+void hdcapm_shadow_invalidate(struct hdcapm_dev *dev);
+
 void hdcapm_set32(struct hdcapm_dev *dev, u32 addr, u32 mask);
 void hdcapm_clr32(struct hdcapm_dev *dev, u32 addr, u32 mask);
 
 int hdcapm_dmawrite32(struct hdcapm_dev *dev, u32 addr, const u32 *arr, u32 entries);
+int hdcapm_dmawrite32_stream(struct hdcapm_dev *dev, u32 addr, const u32 *arr, u32 entries, u32 chunk);
 int hdcapm_dmaread32(struct hdcapm_dev *dev, u32 addr, u32 *arr, u32 entries);
+int hdcapm_dmaread32_buffer(struct hdcapm_dev *dev, u32 addr, struct hdcapm_buffer *buf, u32 entries);
+int hdcapm_core_pipelined_dmaread(struct hdcapm_dev *dev);
 int hdcapm_mem_write32(struct hdcapm_dev *dev, u32 addr, u32 val);
+int hdcapm_mem_fill32(struct hdcapm_dev *dev, u32 addr, u32 entries, u32 val);
 int hdcapm_mem_read32(struct hdcapm_dev *dev, u32 addr, u32 *val);
 
 int hdcapm_core_ep_send(struct hdcapm_dev *dev, int endpoint, u8 *buf, u32 len, u32 timeout);
@@ -254,8 +684,63 @@ int hdcapm_core_ep_recv(struct hdcapm_dev *dev, int endpoint, u8 *buf, u32 len,
 
 int hdcapm_core_stop_streaming(struct hdcapm_dev *dev);
 int hdcapm_core_start_streaming(struct hdcapm_dev *dev);
+int hdcapm_core_wait_stopped(struct hdcapm_dev *dev);
+
+/* Thread side of the capture start / stop hand off. */
+int hdcapm_core_streaming_started(struct hdcapm_dev *dev);
+void hdcapm_core_streaming_stopped(struct hdcapm_dev *dev);
+void hdcapm_core_streaming_abort(struct hdcapm_dev *dev);
+void hdcapm_core_linger(struct hdcapm_dev *dev);
 void hdcapm_core_statistics_reset(struct hdcapm_dev *dev);
 
+/* Bring up / tear down a device on any transport, see hdcapm_usb_probe() and -mock.c. */
+int hdcapm_core_probe(struct device *parent, const struct hdcapm_transport_ops *ops, void *priv,
+	struct usb_device *udev, struct usb_interface *intf, struct hdcapm_dev **out);
+void hdcapm_core_remove(struct hdcapm_dev *dev);
+
+/* -urb.c */
+extern const struct hdcapm_transport_ops hdcapm_usb_transport;
+void hdcapm_urb_xfer_done(struct hdcapm_urb_xfer *xfer, u32 actual, int status);
+void hdcapm_urb_ctx_init(struct hdcapm_dev *dev, struct hdcapm_urb_ctx *ctx);
+void hdcapm_urb_ctx_error(struct hdcapm_urb_ctx *ctx, int status);
+int hdcapm_urb_send(struct hdcapm_urb_ctx *ctx, int endpoint, u8 *buf, u32 len);
+int hdcapm_urb_recv(struct hdcapm_urb_ctx *ctx, int endpoint, u8 *buf, u32 len, u32 *actual);
+int hdcapm_urb_send_copy(struct hdcapm_urb_ctx *ctx, int endpoint, const u8 *buf, u32 len);
+int hdcapm_urb_recv_copy(struct hdcapm_urb_ctx *ctx, int endpoint, u8 *buf, u32 len, u32 *actual);
+int hdcapm_urb_sg_capable(struct hdcapm_dev *dev, struct sg_table *sgt);
+int hdcapm_urb_recv_sg(struct hdcapm_urb_ctx *ctx, int endpoint, struct scatterlist *sg, u32 nents, u32 len, u32 *actual);
+void hdcapm_urb_cancel(struct hdcapm_urb_ctx *ctx);
+struct hdcapm_urb_xfer *hdcapm_urb_xfer_alloc(void);
+void hdcapm_urb_xfer_free(struct hdcapm_urb_xfer *xfer);
+int hdcapm_urb_send_xfer(struct hdcapm_urb_ctx *ctx, struct hdcapm_urb_xfer *xfer, int endpoint, u8 *buf, u32 len);
+int hdcapm_urb_recv_xfer(struct hdcapm_urb_ctx *ctx, struct hdcapm_urb_xfer *xfer, int endpoint, u8 *buf, u32 len, u32 *actual);
+int hdcapm_urb_wait(struct hdcapm_urb_ctx *ctx, u32 timeout);
+void hdcapm_flight_record(struct hdcapm_dev *dev, u8 ep, u32 len, u32 actual, int status, u32 duration_us);
+void hdcapm_ep_stats_record(struct hdcapm_dev *dev, u8 ep, u32 actual, int status, int timedout, u32 duration_us);
+
+/* -mock.c */
+int hdcapm_mock_init(void);
+void hdcapm_mock_exit(void);
+
+/* -debugfs.c */
+void hdcapm_debugfs_init(void);
+void hdcapm_debugfs_exit(void);
+void hdcapm_debugfs_register(struct hdcapm_dev *dev);
+void hdcapm_debugfs_unregister(struct hdcapm_dev *dev);
+
+/* -eval.c, make HDCAPM_EVAL=1 only */
+void hdcapm_eval_register(struct hdcapm_dev *dev);
+
+/* -fw.c */
+struct hdcapm_fw_image {
+	struct kref kref;
+	const struct firmware *fw;
+	char name[32];
+};
+struct hdcapm_fw_image *hdcapm_fw_get(struct hdcapm_dev *dev, const char *name, size_t len);
+void hdcapm_fw_put(struct hdcapm_fw_image *img);
+void hdcapm_fw_cache_flush(void);
+
 /* -i2c.c */
 int hdcapm_i2c_register(struct hdcapm_dev *dev, struct hdcapm_i2c_bus *bus, int nr);
 void hdcapm_i2c_unregister(struct hdcapm_dev *dev, struct hdcapm_i2c_bus *bus);
@@ -277,6 +762,7 @@ int hdcapm_buffer_used_queue_stats(struct hdcapm_dev *dev, u64 *bytes, u64 *item
 int  hdcapm_compressor_register(struct hdcapm_dev *dev);
 void hdcapm_compressor_unregister(struct hdcapm_dev *dev);
 void hdcapm_compressor_run(struct hdcapm_dev *dev);
+void hdcapm_compressor_idle(struct hdcapm_dev *dev, int locked);
 void hdcapm_compressor_init_gpios(struct hdcapm_dev *dev);
 
 /* -video.c */
@@ -638,7 +638,8 @@ static int mst3367_s_power(struct v4l2_subdev *sd, int on)
 		mst3367_init_setup(sd);
 		mst3367_audio_setup(sd);
 	} else {
-		/* Power down */
+		/* Power down, drop the TMDS link so the source stops transmitting. */
+		MST3367_TMDS_HOT_PLUG(sd, RX_TMDS_HPD_OFF);
 	}
 
 	return true;